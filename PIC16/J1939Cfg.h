@@ -94,6 +94,43 @@ Copyright 2003 Kimberly Otten Software Consulting
 #define J1939_RX_QUEUE_BANK            bank2
 #define J1939_OVERWRITE_RX_QUEUE    J1939_FALSE
 
+// If most received messages are short, uncomment the following line.
+// The receive queue then uses the same RAM as J1939_RX_QUEUE_SIZE full
+// messages, but stores each message as only its header and the data
+// bytes it uses, so more short messages fit.  For example, one full
+// message's worth holds two messages with one data byte each.  Messages
+// are copied in and out of the queue one byte at a time, and the queue
+// can't be overwritten.  J1939_RX_QUEUE_SIZE may be up to 18.
+
+//#define J1939_COMPACT_RX_QUEUE
+
+// If some broadcast messages are sent periodically and only their newest
+// value matters, uncomment the following line and set the number of
+// mailboxes.  The CA opens a mailbox for one PGN and source address with
+// J1939_OpenMailbox.  A matching message then replaces the one in the
+// mailbox instead of taking a location in the receive queue, and the CA
+// reads it with J1939_ReadMailbox.  The mailboxes are kept in the receive
+// queue bank.
+
+//#define J1939_MAILBOX_SIZE            2
+
+// If the CA only wants some of the messages it receives, uncomment the
+// following line.  A message is then kept only if the CA has subscribed
+// to its PDU Format with J1939_SubscribePF, or, for a broadcast PDU
+// Format, to its PGN with J1939_SubscribePGN.  Any other message is
+// dropped as soon as it is read, before it takes a location in the
+// receive queue.  Network management messages and mailboxes work as
+// before, but requests reach the CA only if it subscribes to
+// J1939_PF_REQUEST.  The PDU Formats are kept as a 32 byte bit table, so
+// the check takes the same time for every message.  To subscribe to
+// single broadcast PGNs, also uncomment J1939_GE_SUBSCRIPTIONS and set
+// how many there can be.  These are kept sorted and found with a binary
+// search, but only for a PDU Format that has some.  The tables are kept
+// in the receive queue bank.
+
+//#define J1939_SUBSCRIPTIONS
+//#define J1939_GE_SUBSCRIPTIONS        4
+
 // Define the transmit queue size, bank, and whether or not the last
 // location of the queue will be overwritten if a message is enqueued
 // when the queue is full.
@@ -102,6 +139,105 @@ Copyright 2003 Kimberly Otten Software Consulting
 #define J1939_TX_QUEUE_BANK            bank3
 #define J1939_OVERWRITE_TX_QUEUE    J1939_FALSE
 
+// If the CA sends the same PGN periodically, uncomment the following line.
+// When a message is enqueued while one with the same PGN and destination
+// is still waiting in the transmit queue, the waiting message's data is
+// replaced with the new data, instead of queueing a second copy.  With
+// J1939_TX_PRIORITY_BINS, the waiting message must also have the same
+// priority.  Only broadcast PGNs (PDU Format 240-255) are replaced.
+// Messages to one destination, such as requests, acknowledgments, and
+// transport protocol packets, are always queued, since each one carries
+// something different.  This cannot be used with J1939_LOCK_FREE_QUEUES.
+
+//#define J1939_REPLACE_TX_MESSAGES
+
+// If a queue needs more locations than fit in its bank, uncomment its
+// _SIZE2 and _BANK2 lines below to add that many locations in a second
+// bank.  The queue then holds _SIZE + _SIZE2 messages.  The two banks must
+// be in the same half of RAM (banks 0 and 1, or banks 2 and 3), since the
+// library reaches the whole queue through one pointer.  Each access checks
+// which bank a location is in, so this costs some speed and ROM.
+
+//#define J1939_RX_QUEUE_SIZE2        2
+//#define J1939_RX_QUEUE_BANK2        bank3
+//#define J1939_TX_QUEUE_SIZE2        2
+//#define J1939_TX_QUEUE_BANK2        bank2
+
+// If network management messages (Address Claimed, Cannot Claim Address)
+// should have their own transmit buffer, uncomment the following line.
+// TXB2 will be reserved for them at the highest transmit priority, and
+// the transmit queue will use only TXB0 and TXB1.  If TXB2 is still busy
+// after J1939_NM_TX_WAIT status reads, the message is held in a small
+// queue in the transmit queue bank and sent by J1939_TransmitMessages,
+// so the interrupt routine never waits behind application messages.  If
+// that queue is full, its last location is overwritten, since the newest
+// claim is the one that counts.
+
+//#define J1939_NM_TX_LANE
+#define J1939_NM_TX_WAIT            8
+#define J1939_NM_QUEUE_SIZE            2
+
+// If a message with a higher J1939 priority should not wait behind lower
+// priority messages that are already loaded in the transmit buffers,
+// uncomment the following line.  When the next message in the transmit
+// queue is more urgent than everything in the transmit buffers, the least
+// urgent of those is aborted and put back at the head of the queue, and
+// the urgent message goes out at the next arbitration.  The transmit
+// queue then keeps the highest TXP for these messages.  If the aborted
+// message is still going out after J1939_TX_PREEMPT_WAIT status reads,
+// it is left to finish, and the urgent message waits for the next
+// transmit interrupt, so the interrupt routine never waits for the bus.
+// J1939_TX_PREEMPT_WAIT must be at least 1.
+
+//#define J1939_TX_PREEMPTION
+#define J1939_TX_PREEMPT_WAIT        8
+
+// If the transmit queue should send the most urgent messages first,
+// uncomment the following line.  The queue is then kept as one bin for
+// each J1939 priority, and messages with the same priority are sent in
+// the order they were queued.  The queue still holds J1939_TX_QUEUE_SIZE
+// messages in total.  If it is full and can be overwritten, the newest
+// message with the lowest priority is dropped.
+
+//#define J1939_TX_PRIORITY_BINS
+
+// If the CA and the interrupt routine should not have to disable
+// interrupts to share the receive and transmit queues, uncomment the
+// following line.  Each queue is then a ring that only one side adds to
+// and only the other side takes from.  Both queue sizes must be powers
+// of two (up to 128, counting both banks of a queue that has a second
+// one), neither queue may be overwritten, and this cannot be used with
+// J1939_TX_PRIORITY_BINS.  Interrupts are still disabled
+// briefly when the transmit interrupt has to be turned back on, since
+// that needs the SPI port.
+
+//#define J1939_LOCK_FREE_QUEUES
+
+// If the CA needs to know how busy the library is, for example to size
+// the queues, uncomment the following line.  The library then counts the
+// messages it receives, sends, and drops, how full the queues get, and
+// how many SPI transactions it makes.  The CA reads the counts with
+// J1939_ReadStatistics.
+
+//#define J1939_COLLECT_STATISTICS
+
+// If the CA needs to know how busy the bus is, uncomment the following
+// line.  The library then adds up the length of each message it sends or
+// reads, as 70 bits plus 9 for each data byte, which allows for the stuff
+// bits a J1939 message usually needs and the space between messages.
+// J1939_Poll works out the bus load at the end of each
+// J1939_BUS_LOAD_WINDOW milliseconds.  The library also counts the sent
+// messages that lost arbitration or had an error, which costs one more
+// SPI transaction for each message sent.  The CA reads these, and the
+// MCP2515's error counters, with J1939_ReadBusLoad.  The bit rate is
+// worked out from J1939_CNF1-3 below and J1939_CLOCK_FREQUENCY, the
+// MCP2515's oscillator frequency in Hz.  Only the messages that pass the
+// receive filters are seen, so the real load can be higher.
+
+//#define J1939_MEASURE_BUS_LOAD
+#define J1939_BUS_LOAD_WINDOW        1000
+#define J1939_CLOCK_FREQUENCY        16000000
+
 
 // Stack vs. ROM Configuration
 
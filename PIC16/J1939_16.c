@@ -48,23 +48,311 @@ unsigned char                             ContentionWaitTime;
 unsigned char                             J1939_Address;
 J1939_FLAG                                J1939_Flags;
 J1939_TX_QUEUE_BANK J1939_MESSAGE         OneMessage;
+#ifdef J1939_COLLECT_STATISTICS
+    J1939_STATISTICS                      J1939_Statistics;
+#endif
+#ifdef J1939_MEASURE_BUS_LOAD
+    J1939_BUS_LOAD                        J1939_BusLoad;
+    unsigned long                         BusLoadBits;
+    unsigned int                          BusLoadTime;
+#endif
+
+// A queue can be spread over a second RAM bank by defining its _SIZE2
+// and _BANK2 (see J1939Cfg.h).  The locations in the first bank come
+// first, and RX_MSG and TX_MSG return a pointer to a location in either
+// bank.  The queue-bank pointer reaches both, since the two banks must be
+// in the same half of RAM.
+
+#ifdef J1939_RX_QUEUE_SIZE2
+    #define RX_QUEUE_LENGTH    (J1939_RX_QUEUE_SIZE + J1939_RX_QUEUE_SIZE2)
+    #define RX_MSG(Index)    (((Index) < J1939_RX_QUEUE_SIZE) ?                     \
+                            (J1939_RX_QUEUE_BANK J1939_MESSAGE *) &(RXQueue[Index]) :   \
+                            (J1939_RX_QUEUE_BANK J1939_MESSAGE *) &(RXQueue2[(Index) - J1939_RX_QUEUE_SIZE]))
+#else
+    #define RX_QUEUE_LENGTH    J1939_RX_QUEUE_SIZE
+    #define RX_MSG(Index)    (&(RXQueue[Index]))
+#endif
+#ifdef J1939_TX_QUEUE_SIZE2
+    #define TX_QUEUE_LENGTH    (J1939_TX_QUEUE_SIZE + J1939_TX_QUEUE_SIZE2)
+    #define TX_MSG(Index)    (((Index) < J1939_TX_QUEUE_SIZE) ?                     \
+                            (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &(TXQueue[Index]) :   \
+                            (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &(TXQueue2[(Index) - J1939_TX_QUEUE_SIZE]))
+#else
+    #define TX_QUEUE_LENGTH    J1939_TX_QUEUE_SIZE
+    #define TX_MSG(Index)    (&(TXQueue[Index]))
+#endif
 
+#ifdef J1939_LOCK_FREE_QUEUES
+J1939_RX_QUEUE_BANK volatile unsigned char RXHead;
+J1939_RX_QUEUE_BANK volatile unsigned char RXTail;
+#else
 J1939_RX_QUEUE_BANK unsigned char RXHead;
 J1939_RX_QUEUE_BANK unsigned char RXTail;
 J1939_RX_QUEUE_BANK unsigned char RXQueueCount;
+#endif
+#ifdef J1939_COMPACT_RX_QUEUE
+#define RX_QUEUE_BYTES    (J1939_RX_QUEUE_SIZE * (J1939_MSG_LENGTH + J1939_DATA_LENGTH))
+J1939_RX_QUEUE_BANK unsigned char RXEnd;
+J1939_RX_QUEUE_BANK unsigned char RXQueue[RX_QUEUE_BYTES];
+#else
 J1939_RX_QUEUE_BANK J1939_MESSAGE RXQueue[J1939_RX_QUEUE_SIZE];
+#endif
+#ifdef J1939_RX_QUEUE_SIZE2
+J1939_RX_QUEUE_BANK2 J1939_MESSAGE RXQueue2[J1939_RX_QUEUE_SIZE2];
+#endif
 
+// Each mailbox keeps the newest message for one broadcast PGN.  The PGN
+// is kept in the message header itself, since every message stored there
+// has the same one.  MailboxSource holds the source address to accept, or
+// the global address to accept any source.
+
+#define MAILBOX_CLOSED    0
+#define MAILBOX_READ    1
+#define MAILBOX_NEW        2
+#ifdef J1939_MAILBOX_SIZE
+J1939_RX_QUEUE_BANK J1939_MESSAGE Mailbox[J1939_MAILBOX_SIZE];
+J1939_RX_QUEUE_BANK unsigned char MailboxSource[J1939_MAILBOX_SIZE];
+J1939_RX_QUEUE_BANK unsigned char MailboxState[J1939_MAILBOX_SIZE];
+#endif
+
+// SubscribedPF has a bit for each PDU Format the CA keeps.  SubscribedGE
+// has a bit for each broadcast PDU Format that has single PGNs in the
+// table, which is sorted by PDU Format and then Group Extension.
+
+#ifdef J1939_SUBSCRIPTIONS
+J1939_RX_QUEUE_BANK unsigned char SubscribedPF[32];
+#endif
+#ifdef J1939_GE_SUBSCRIPTIONS
+    #ifndef J1939_SUBSCRIPTIONS
+        #error J1939_GE_SUBSCRIPTIONS needs J1939_SUBSCRIPTIONS
+    #endif
+J1939_RX_QUEUE_BANK unsigned char SubscribedGE[2];
+J1939_RX_QUEUE_BANK unsigned char SubscribedPGNPF[J1939_GE_SUBSCRIPTIONS];
+J1939_RX_QUEUE_BANK unsigned char SubscribedPGNGE[J1939_GE_SUBSCRIPTIONS];
+J1939_RX_QUEUE_BANK unsigned char SubscribedPGNCount;
+#endif
+
+#ifdef J1939_LOCK_FREE_QUEUES
+J1939_TX_QUEUE_BANK volatile unsigned char TXHead;
+J1939_TX_QUEUE_BANK volatile unsigned char TXTail;
+#else
 J1939_TX_QUEUE_BANK unsigned char TXHead;
+#ifndef J1939_TX_PRIORITY_BINS
 J1939_TX_QUEUE_BANK unsigned char TXTail;
+#endif
 J1939_TX_QUEUE_BANK unsigned char TXQueueCount;
+#endif
+J1939_TX_QUEUE_BANK unsigned char TXReserved;
 J1939_TX_QUEUE_BANK J1939_MESSAGE TXQueue[J1939_TX_QUEUE_SIZE];
+#ifdef J1939_TX_QUEUE_SIZE2
+J1939_TX_QUEUE_BANK2 J1939_MESSAGE TXQueue2[J1939_TX_QUEUE_SIZE2];
+#endif
+
+#ifdef J1939_TX_PRIORITY_BINS
+J1939_TX_QUEUE_BANK unsigned char TXFree;
+J1939_TX_QUEUE_BANK unsigned char TXNext[TX_QUEUE_LENGTH];
+J1939_TX_QUEUE_BANK unsigned char TXBinHead[8];
+J1939_TX_QUEUE_BANK unsigned char TXBinTail[8];
+#endif
+J1939_TX_QUEUE_BANK unsigned char TXKey[3];
+#ifdef J1939_TX_PREEMPTION
+J1939_TX_QUEUE_BANK unsigned char TXPriority[3];
+#endif
+
+#ifdef J1939_NM_TX_LANE
+J1939_TX_QUEUE_BANK unsigned char NMHead;
+J1939_TX_QUEUE_BANK unsigned char NMTail;
+J1939_TX_QUEUE_BANK unsigned char NMQueueCount;
+J1939_TX_QUEUE_BANK J1939_MESSAGE NMQueue[J1939_NM_QUEUE_SIZE];
+#endif
 
 
 // Code definitions for common functions, to make it a little easier to read.
 
-#define SELECT_MCP        J1939_CS_PIN = 0;
+#define SELECT_MCP        J1939_CS_PIN = 0; STAT_COUNT( SPITransactions );
 #define UNSELECT_MCP     J1939_CS_PIN = 1;
 
+// With J1939_COLLECT_STATISTICS, these keep the counts in J1939_Statistics.
+// Otherwise, they leave an empty statement.
+
+#ifdef J1939_COLLECT_STATISTICS
+    #define STAT_COUNT(Counter)            J1939_Statistics.Counter ++
+    #define STAT_HIGH_WATER(Mark, Count)    if ((Count) > J1939_Statistics.Mark) J1939_Statistics.Mark = (Count)
+#else
+    #define STAT_COUNT(Counter)
+    #define STAT_HIGH_WATER(Mark, Count)
+#endif
+
+// With J1939_MEASURE_BUS_LOAD, this adds a message's estimated length in
+// bits to the bus load.  Otherwise, it leaves an empty statement.  The bit
+// rate comes from the MCP2515 bit timing: one time quantum is
+// 2 * (BRP + 1) oscillator periods, and a bit is the sync segment plus
+// the propagation and two phase segments.  Without BTLMODE, phase
+// segment 2 is the same length as phase segment 1.
+
+#ifdef J1939_MEASURE_BUS_LOAD
+    #define BUS_LOAD_COUNT(Length)        BusLoadBits += 70 + 9 * (Length)
+    #ifndef J1939_BUS_BIT_RATE
+        #define J1939_BUS_BIT_RATE        (J1939_CLOCK_FREQUENCY /                  \
+                                        (2l * ((J1939_CNF1 & 0x3F) + 1) *         \
+                                        (4 + (J1939_CNF2 & 0x07) +                \
+                                        ((J1939_CNF2 >> 3) & 0x07) +              \
+                                        ((J1939_CNF2 & BTLMODE) ? (J1939_CNF3 & 0x07) : ((J1939_CNF2 >> 3) & 0x07)))))
+    #endif
+    #if (J1939_BUS_LOAD_WINDOW > 60000) || (J1939_BUS_LOAD_WINDOW * (J1939_BUS_BIT_RATE / 1000) > 4000000)
+        #error J1939_BUS_LOAD_WINDOW is too long for the bit rate
+    #endif
+#else
+    #define BUS_LOAD_COUNT(Length)
+#endif
+
+// The transmit queue uses all three transmit buffers.  If network
+// management messages have their own lane, TXB2 belongs to them, so the
+// transmit queue uses only TXB0 and TXB1 and must leave the TXB2 interrupt
+// enable alone.
+//
+// Each message loaded for the transmit queue gets a key made of its TXP
+// priority and buffer number, (TXP << 2) | Buffer.  The MCP2515 sends the
+// highest TXP first, and the highest buffer number first within a TXP, so
+// the higher the key, the sooner the message goes out.  TX_TOP_KEY is the
+// highest key the transmit queue may use.  Express messages (network
+// management messages in their own lane, and urgent messages that preempt
+// the transmit buffers) are loaded at the highest TXP, above TX_TOP_KEY,
+// so they always go out first.  TX_EXPRESS is not a transmit request bit,
+// so it is passed to SendOneMessage along with the buffer bits.
+
+#define TX_EXPRESS    0x01
+
+#ifdef J1939_NM_TX_LANE
+    #define APP_TX_MASK    MCP_TX01_MASK
+    #define TX_INT_MASK    MCP_TX01_INT
+    #define TX_TOP_KEY    ((TXP_HIGH << 2) | 1)
+#else
+    #define APP_TX_MASK    MCP_TX_MASK
+    #define TX_INT_MASK    MCP_TX_INT
+    #ifdef J1939_TX_PREEMPTION
+        #define TX_TOP_KEY    ((TXP_HIGH << 2) | 2)
+    #else
+        #define TX_TOP_KEY    ((TXP_HIGHEST << 2) | 2)
+    #endif
+#endif
+
+// With priority bins, the transmit queue locations are linked into one
+// list per J1939 priority, plus a free list.  TX_NO_SLOT ends a list.
+// A location reserved with J1939_ReserveTxSlot is already off the free
+// list, so the queue is full when the free list is empty.
+
+#define TX_NO_SLOT    0xFF
+
+#ifdef J1939_TX_PRIORITY_BINS
+    #define TX_QUEUE_FULL    (TXFree == TX_NO_SLOT)
+#else
+    #define TX_QUEUE_FULL    (TXQueueCount >= TX_QUEUE_LENGTH)
+#endif
+
+// A received message may be overwritten only if the receive queue allows
+// it and the CA isn't holding that location with J1939_PeekMessage.
+
+#define RX_CAN_OVERWRITE    ((J1939_OVERWRITE_RX_QUEUE == J1939_TRUE) &&            \
+                             !(J1939_Flags.Flags.ReceivedMessageHeld && (RXTail == RXHead)))
+
+// With lock-free queues, the receive and transmit queues are single
+// producer, single consumer rings.  The head and tail are free running
+// counts of the messages taken out and put in.  Only the consumer moves
+// the head and only the producer moves the tail, each after it is done
+// with the location, so the CA and the interrupt routine never need to
+// lock each other out.  The queue count is the difference, and the sizes
+// must be powers of two so the counts can be masked into locations.
+// Nothing else may move a head or tail, so these queues can't be
+// overwritten or kept in priority bins.  Otherwise, the queue functions
+// disable interrupts around their updates.
+
+#ifdef J1939_LOCK_FREE_QUEUES
+    #if (RX_QUEUE_LENGTH & (RX_QUEUE_LENGTH - 1)) || (RX_QUEUE_LENGTH > 128) || \
+        (TX_QUEUE_LENGTH & (TX_QUEUE_LENGTH - 1)) || (TX_QUEUE_LENGTH > 128)
+        #error J1939_LOCK_FREE_QUEUES needs queue sizes that are powers of two, up to 128
+    #endif
+    #if (J1939_OVERWRITE_RX_QUEUE == J1939_TRUE) || (J1939_OVERWRITE_TX_QUEUE == J1939_TRUE)
+        #error J1939_LOCK_FREE_QUEUES queues cannot be overwritten
+    #endif
+    #ifdef J1939_TX_PRIORITY_BINS
+        #error J1939_LOCK_FREE_QUEUES cannot be used with J1939_TX_PRIORITY_BINS
+    #endif
+    #ifdef J1939_REPLACE_TX_MESSAGES
+        #error J1939_LOCK_FREE_QUEUES cannot be used with J1939_REPLACE_TX_MESSAGES
+    #endif
+
+    #define TXQueueCount    ((unsigned char)(TXTail - TXHead))
+    #define RX_SLOT(Count)    ((Count) & (RX_QUEUE_LENGTH - 1))
+    #define TX_SLOT(Count)    ((Count) & (TX_QUEUE_LENGTH - 1))
+    #define RX_HEAD        RX_SLOT(RXHead)
+    #define TX_HEAD        TX_SLOT(TXHead)
+    #define RX_POP        RXHead ++;
+    #define TX_POP        TXHead ++;
+    #define LOCK_QUEUES
+    #define UNLOCK_QUEUES
+#else
+    #ifdef J1939_COMPACT_RX_QUEUE
+        #define RX_POP    RXQueueTake( 0 );
+    #else
+        #define RX_HEAD    RXHead
+        #define RX_POP    { RXHead ++; if (RXHead >= RX_QUEUE_LENGTH) RXHead = 0; RXQueueCount --; }
+    #endif
+    #define TX_HEAD        TXHead
+    #define TX_POP        { TXHead ++; if (TXHead >= TX_QUEUE_LENGTH) TXHead = 0; TXQueueCount --; }
+    #ifdef J1939_POLL_MCP
+        #define LOCK_QUEUES
+        #define UNLOCK_QUEUES
+    #else
+        #define LOCK_QUEUES        INTE = 0;
+        #define UNLOCK_QUEUES    INTE = 1;
+    #endif
+#endif
+
+// With a compact receive queue, RXQueue is a byte array the size of
+// J1939_RX_QUEUE_SIZE full messages (see RX_QUEUE_BYTES), and each message
+// is stored as its header and only the data bytes it uses.  RXHead and
+// RXTail are byte offsets, and RXQueueCount still counts messages.  A
+// record is never split across the end of the array, so a pointer to it
+// can still be used as a J1939_MESSAGE.  When the writer skips the unused
+// space at the end, RXEnd marks where the records stop.  RXTail plus a
+// full message must fit in an unsigned char.  The records can't be
+// replaced in place, since the new message may be longer, so this can't
+// be used with an overwritten receive queue or lock-free queues.
+
+#ifdef J1939_COMPACT_RX_QUEUE
+    #if J1939_OVERWRITE_RX_QUEUE == J1939_TRUE
+        #error J1939_COMPACT_RX_QUEUE cannot be used with J1939_OVERWRITE_RX_QUEUE
+    #endif
+    #ifdef J1939_LOCK_FREE_QUEUES
+        #error J1939_COMPACT_RX_QUEUE cannot be used with J1939_LOCK_FREE_QUEUES
+    #endif
+    #if J1939_RX_QUEUE_SIZE > 18
+        #error J1939_COMPACT_RX_QUEUE allows a J1939_RX_QUEUE_SIZE of up to 18
+    #endif
+    #ifdef J1939_RX_QUEUE_SIZE2
+        #error J1939_COMPACT_RX_QUEUE cannot be spread over two banks
+    #endif
+#endif
+
+// Send the network management message in OneMessage, which must already
+// be encoded.  With a network management lane, the message goes in TXB2,
+// or is queued if TXB2 doesn't free up in time (or earlier messages are
+// still waiting).  This is a macro to save a stack level.
+
+#ifdef J1939_NM_TX_LANE
+    #define SendNetworkMessage()                                                \
+                    {                                                           \
+                        if ((NMQueueCount != 0) ||                              \
+                            (SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage, \
+                                             MCP_STAT_TX2REQ | TX_EXPRESS, J1939_NM_TX_WAIT ) != RC_SUCCESS)) \
+                            QueueNetworkMessage();                              \
+                    }
+#else
+    #define SendNetworkMessage()                                                \
+                    SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage, APP_TX_MASK, 0 )
+#endif
+
 
 // Function Prototypes
 
@@ -244,36 +532,27 @@ void MCP_Write( unsigned char Address, unsigned char Data )
 }
 
 /*********************************************************************
-SendOneMessage
+EncodeMessage
 
-This routine sends the message located at the pointer passed in.  It
-also uses the message's data length field to determine how much of the
-data to load.  At this point, all of the data fields, such as data
-length, priority, and source address, must be set.  This routine will
-set up the CAN bits, such as the extended identifier bit and the
-remote transmission request bit.
+This routine converts a message from the CA's format into the image of
+the MCP2515 TXBnSIDH through TXBnDn registers.  It sets up the CAN bits,
+such as the extended identifier bit and the remote transmission request
+bit, and makes sure DataLength isn't out of spec.  This is done once,
+when the message is queued, so the transmit routines only have to
+stream the image out to the MCP2515.
 
-NOTE: Only transmit buffers 0 and 1 are used, to guarantee that the
-messages appear on the bus in the order that they are sent to the
-MCP2515.
+NOTE: After this routine, PDUFormat no longer holds the CA's value.
 
-Parameters:    J1939_MESSAGE far *        Pointer to message to send
+Parameters:    J1939_MESSAGE *        Pointer to message to encode
 Return:        None
 *********************************************************************/
 #ifndef J1939_POLL_MCP
 #pragma interrupt_level 0
 #endif
-void SendOneMessage( J1939_TX_QUEUE_BANK J1939_MESSAGE *MsgPtr )
+void EncodeMessage( J1939_TX_QUEUE_BANK J1939_MESSAGE *MsgPtr )
 {
-//    unsigned char oldSIDL;
-    unsigned char MCP_Load;
-    unsigned char Loop;
-    unsigned char MCP_Send;
     unsigned char Temp;
 
-    // Set up the final pieces of the message and make sure DataLength isn't
-    // out of spec.
-
     MsgPtr->Msg.Res = 0;
     MsgPtr->Msg.RTR = 0;
     if (MsgPtr->Msg.DataLength > 8)
@@ -283,18 +562,64 @@ void SendOneMessage( J1939_TX_QUEUE_BANK J1939_MESSAGE *MsgPtr )
     // involves splitting the original value in PDUFormat into two pieces,
     // leaving some holes for the TXBnSIDL register, and setting the EXIDE bit.
 
-//    oldSIDL = MsgPtr->Msg.PDUFormat;
     MsgPtr->Msg.PDUFormat_Top = MsgPtr->Msg.PDUFormat >> 5;        // Put the top three bits into SID5-3
     Temp = MsgPtr->Msg.PDUFormat & 0x03;                        // Save the bottom two bits.
     MsgPtr->Msg.PDUFormat = (MsgPtr->Msg.PDUFormat & 0x1C) << 3;// Move up bits 4-2 into SID2-0.
     MsgPtr->Msg.PDUFormat |= Temp | 0x08;                        // Put back EID17-16, set EXIDE.
+}
+
+/*********************************************************************
+SendOneMessage
+
+This routine sends the message located at the pointer passed in.  The
+message must already have been converted with EncodeMessage.  The
+message's data length field is used to determine how much of the data
+to load.  At this point, all of the data fields, such as data length,
+priority, and source address, must be set.
+
+To keep the messages in the order that they are sent to the MCP2515
+while keeping every transmit buffer busy, each message is given a key
+(see TX_TOP_KEY) lower than that of any message still waiting in a
+transmit buffer.  If they're all empty, we can start again at the top.
+If there is no free buffer with a lower key, we must wait for the
+buffers to empty.  Express messages skip all of this and take any free
+buffer at the highest TXP.
+
+The TXP priority and the register image are streamed to the MCP2515 in
+one burst, starting at TXBnCTRL.  The header bytes and each possible
+data length are unrolled, so there is no loop or function call overhead
+per byte.
+
+Parameters:    J1939_MESSAGE far *        Pointer to message to send
+            unsigned char            READ STATUS transmit request bits
+                                    of the buffers that may be used,
+                                    plus TX_EXPRESS if needed
+            unsigned char            Number of times to check for a
+                                    free buffer, or 0 to wait until
+                                    there is one
+Return:        RC_SUCCESS            Message was loaded and sent
+            RC_CANNOTTRANSMIT    No buffer was available in time
+*********************************************************************/
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+unsigned char SendOneMessage( J1939_TX_QUEUE_BANK J1939_MESSAGE *MsgPtr, unsigned char Buffers,
+                                unsigned char Tries )
+{
+    J1939_TX_QUEUE_BANK unsigned char *Ptr;
+    unsigned char Buffer;
+    unsigned char Key;
+    unsigned char Mask;
+    unsigned char MCP_Ctrl;
+    unsigned char MCP_Send;
+    unsigned char Next;
+    unsigned char Temp;
 
     // Decide which transmit buffer to use.  Lower chip select, and then
-    // do a Read Status command.  Look at the transmit status bits
-    // to see which buffer is ready.  We may need a time-out here.
+    // do a Read Status command.  Look at the transmit status bits of the
+    // buffers we may use to see which ones are ready.
 
-    MCP_Load = 0;
-    while (MCP_Load == 0)
+    while (1)
     {
         SELECT_MCP;
         #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
@@ -305,38 +630,108 @@ void SendOneMessage( J1939_TX_QUEUE_BANK J1939_MESSAGE *MsgPtr )
             Temp = ReadSPI();
         #endif
         UNSELECT_MCP;
-        if (!(Temp & 0x04))
+
+        if (Buffers & TX_EXPRESS)
+            Key = (TXP_HIGHEST << 2) | 0x03;
+        else
         {
-            MCP_Load = MCP_LOAD_TX0;
-            MCP_Send = MCP_RTS_TX0;
+            // Find the lowest key still waiting in one of our buffers.
+            // Express keys are above TX_TOP_KEY, so they don't count.
+            Key = TX_TOP_KEY + 1;
+            Mask = MCP_STAT_TX0REQ;
+            for (Buffer = 0; Buffer < 3; Buffer++)
+            {
+                if ((Temp & Buffers & Mask) && (TXKey[Buffer] < Key))
+                    Key = TXKey[Buffer];
+                Mask <<= 2;
+            }
         }
-        else if (!(Temp & 0x10))
+
+        // Work down from there to the first free buffer we may use.
+        Temp = ~Temp & Buffers;
+        while (Key != 0)
         {
-            MCP_Load = MCP_LOAD_TX1;
-            MCP_Send = MCP_RTS_TX1;
+            Key --;
+            if (((Key & 0x03) != 0x03) &&
+                (Temp & (MCP_STAT_TX0REQ << ((Key & 0x03) << 1))))
+                goto LoadBuffer;
         }
-    }
 
-    // Load the message buffer.  Lower the chip select line, and point
-    // the loader to TXB0SIDH. Send out the first 5 bytes of the message,
-    // then send out whatever part of the data is necessary.  Then raise
-    // the chip select line.
+        if (Tries && (--Tries == 0))
+            return RC_CANNOTTRANSMIT;
+    }
 
-    SELECT_MCP;
-    #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-        WRITESPI( MCP_Load );
-    #else
-        WriteSPI( MCP_Load );
+LoadBuffer:
+    TXKey[Key & 0x03] = Key;
+    #ifdef J1939_TX_PREEMPTION
+        TXPriority[Key & 0x03] = MsgPtr->Msg.Priority;
     #endif
-    for (Loop=0; Loop<J1939_MSG_LENGTH+MsgPtr->Msg.DataLength;  Loop++)
+    if ((Key & 0x03) == 0)
+    {
+        MCP_Ctrl = MCP_TXB0CTRL;
+        MCP_Send = MCP_RTS_TX0;
+    }
+    else if ((Key & 0x03) == 1)
     {
-        Temp = MsgPtr->Array[Loop];
+        MCP_Ctrl = MCP_TXB1CTRL;
+        MCP_Send = MCP_RTS_TX1;
+    }
+    else
+    {
+        MCP_Ctrl = MCP_TXB2CTRL;
+        MCP_Send = MCP_RTS_TX2;
+    }
+
+    // The status of the last message sent from this buffer is cleared
+    // when we ask for the next one, so check it now.
+
+    #ifdef J1939_MEASURE_BUS_LOAD
+        SELECT_MCP;
         #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-            WRITESPI( Temp );
+            WRITESPI( MCP_READ );
+            WRITESPI( MCP_Ctrl );
+            READSPI( Temp );
         #else
-            WriteSPI( Temp );
+            WriteSPI( MCP_READ );
+            WriteSPI( MCP_Ctrl );
+            Temp = ReadSPI();
         #endif
+        UNSELECT_MCP;
+        if (Temp & MCP_TXB_MLOA)
+            J1939_BusLoad.ArbitrationLost ++;
+        if (Temp & MCP_TXB_TXERR)
+            J1939_BusLoad.TXErrors ++;
+    #endif
+
+    // Load the message buffer.  Lower the chip select line, and point
+    // the writer to TXBnCTRL.  Send out the TXP priority and the first
+    // 5 bytes of the message, then fall into the data length case to send
+    // out whatever part of the data is necessary.  Then raise the chip
+    // select line.
+
+    Ptr = MsgPtr->Array;
+    SELECT_MCP;
+    BURSTSPI_FIRST( MCP_WRITE, Temp );
+    BURSTSPI_NEXT( MCP_Ctrl, Next, Temp );
+    BURSTSPI_NEXT( Key >> 2, Next, Temp );      // TXBnCTRL
+    BURSTSPI_NEXT( *Ptr++, Next, Temp );        // TXBnSIDH
+    BURSTSPI_NEXT( *Ptr++, Next, Temp );        // TXBnSIDL
+    BURSTSPI_NEXT( *Ptr++, Next, Temp );        // TXBnEID8
+    BURSTSPI_NEXT( *Ptr++, Next, Temp );        // TXBnEID0
+    BURSTSPI_NEXT( *Ptr++, Next, Temp );        // TXBnDLC
+    switch (MsgPtr->Msg.DataLength)
+    {
+        case 8:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 7:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 6:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 5:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 4:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 3:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 2:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        case 1:    BURSTSPI_NEXT( *Ptr++, Next, Temp );
+        default:   break;
     }
+    BURSTSPI_LAST( Temp );
     UNSELECT_MCP;
 
     // Now tell the MCP to send the message.  Lower the chip select line,
@@ -368,197 +763,1103 @@ void SendOneMessage( J1939_TX_QUEUE_BANK J1939_MESSAGE *MsgPtr )
         UNSELECT_MCP;
     #endif
 
-    // Put back PDUFormat the way it was in case somebody reuses the message.
-//    MsgPtr->Msg.PDUFormat = oldSIDL;
+    STAT_COUNT( TXFrames );
+    BUS_LOAD_COUNT( MsgPtr->Msg.DataLength );
+    return RC_SUCCESS;
 }
 
 /*********************************************************************
-J1939_AddressClaimHandling
+QueueNetworkMessage
 
-This routine is called either when the CA must claim its address on
-the bus or another CA is trying to claim the same address on the bus and
-we must either defend ourself or relinquish the address.  If the CA has
-an address in the proprietary range of 0-127 or 248-253, it can take
-the address immediately.
+This routine is used when TXB2 is not available for a network management
+message.  The message in OneMessage, which is already encoded, is placed
+in the network management queue, and J1939_TransmitMessages will send it
+once TXB2 is free.  If interrupts are being used, the TXB2 interrupt is
+enabled so that will happen as soon as possible.
 
-Parameters:    unsigned char    ADDRESS_CLAIM_RX indicates an Address
-                            Claim message has been received and this
-                            CA must either defend or give up its
-                            address.
-                            ADDRESS_CLAIM_TX indicates that the CA is
-                            initiating a claim to its address.
+Parameters:    None
 Return:        None
 *********************************************************************/
+#ifdef J1939_NM_TX_LANE
 #ifndef J1939_POLL_MCP
 #pragma interrupt_level 0
 #endif
-void J1939_AddressClaimHandling( unsigned char Mode )
+void QueueNetworkMessage( void )
 {
-    // Get most of the message ready here, since it'll be very similar
-    // for both messages to be sent.  Note that J1939_PF_ADDRESS_CLAIMED
-    // is the same value as J1939_PF_CANNOT_CLAIM_ADDRESS.  We can't copy
-    // the data yet because we might need to look at the old data.
+    if (NMQueueCount < J1939_NM_QUEUE_SIZE)
+    {
+        NMQueueCount ++;
+        NMTail ++;
+        if (NMTail >= J1939_NM_QUEUE_SIZE)
+            NMTail = 0;
+    }
+    else
+        STAT_COUNT( NMDropped );
+    NMQueue[NMTail] = OneMessage;
 
-    OneMessage.Msg.Priority = J1939_CONTROL_PRIORITY;
-    OneMessage.Msg.PDUFormat = J1939_PF_ADDRESS_CLAIMED;
-    OneMessage.Msg.DestinationAddress = J1939_GLOBAL_ADDRESS;
-    OneMessage.Msg.DataLength = J1939_DATA_LENGTH;
+    #ifndef J1939_POLL_MCP
+        // Enable the transmit interrupt on TXB2
+        SELECT_MCP;
+        #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+            WRITESPI( MCP_BITMOD );
+            WRITESPI( MCP_CANINTE );
+            WRITESPI( MCP_TX2_INT );
+            WRITESPI( MCP_TX2_INT );
+        #else
+            WriteSPI( MCP_BITMOD );
+            WriteSPI( MCP_CANINTE );
+            WriteSPI( MCP_TX2_INT );
+            WriteSPI( MCP_TX2_INT );
+        #endif
+        UNSELECT_MCP;
+    #endif
+}
+#endif
 
-    if (Mode == ADDRESS_CLAIM_TX)
-        goto SendAddressClaim;
+/*********************************************************************
+TXBinPush
 
-    if (OneMessage.Msg.SourceAddress != J1939_Address)
-        return;
-    if (CompareName( OneMessage.Msg.Data ) != -1) // Our CA_Name is not less
-    {
-        // Send Cannot Claim Address message
-        CopyName();
-        OneMessage.Msg.SourceAddress = J1939_NULL_ADDRESS;
-        SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+This routine links a transmit queue location into the bin for its
+message's J1939 priority, either at the end (a new message) or at the
+front (a message that was taken back out of a transmit buffer), and
+updates TXHead if the message is now the most urgent one.
 
-        // Set up MCP filter 2 to receive messages sent to the global address
-        SetAddressFilter( J1939_GLOBAL_ADDRESS );
+Parameters:    unsigned char    Transmit queue location
+            unsigned char    Nonzero to put it at the front of its bin
+Return:        None
+*********************************************************************/
+#ifdef J1939_TX_PRIORITY_BINS
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+void TXBinPush( unsigned char Slot, unsigned char Front )
+{
+    unsigned char Bin;
 
-        J1939_Flags.Flags.CannotClaimAddress = 1;
-        J1939_Flags.Flags.WaitingForAddressClaimContention = 0;
-        return;
+    Bin = TX_MSG(Slot)->Msg.Priority;
+    if (TXBinHead[Bin] == TX_NO_SLOT)
+    {
+        TXBinHead[Bin] = Slot;
+        TXBinTail[Bin] = Slot;
+        TXNext[Slot] = TX_NO_SLOT;
     }
-
-SendAddressClaim:
-    // Send Address Claim message for CommandedAddress
-    CopyName();
-    OneMessage.Msg.SourceAddress = CommandedAddress;
-    SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
-
-    if (((CommandedAddress & 0x80) == 0) ||            // Addresses 0-127
-        ((CommandedAddress & 0xF8) == 0xF8))        // Addresses 248-253 (254,255 illegal)
+    else if (Front)
     {
-        J1939_Flags.Flags.CannotClaimAddress = 0;
-        J1939_Address = CommandedAddress;
-
-        // Set up MCP filter 2 to receive messages sent to this address
-        SetAddressFilter( J1939_Address );
+        TXNext[Slot] = TXBinHead[Bin];
+        TXBinHead[Bin] = Slot;
     }
     else
     {
-        // We don't have a proprietary address, so we need to wait.
-         J1939_Flags.Flags.WaitingForAddressClaimContention = 1;
-        ContentionWaitTime = 0;
+        TXNext[TXBinTail[Bin]] = Slot;
+        TXBinTail[Bin] = Slot;
+        TXNext[Slot] = TX_NO_SLOT;
     }
+    TXQueueCount ++;
+
+    if ((TXHead == TX_NO_SLOT) || (Bin <= TX_MSG(TXHead)->Msg.Priority))
+        TXHead = TXBinHead[Bin];
 }
 
 /*********************************************************************
-J1939_DequeueMessage
+TXBinPop
 
-This routine takes a message from the receive queue and places it in
-the caller's buffer.  If there is no message to return, an appropriate
-return code is returned.
+This routine unlinks the message at TXHead from its bin and moves
+TXHead to the next message, which is either the next one in the same
+bin or the first one in the next less urgent bin that isn't empty.
 
-Parameters:    J1939_MESSAGE *        Pointer to the caller's message buffer
-Return:        RC_SUCCESS            Message dequeued successfully
-            RC_QUEUEEMPTY        No messages to return
-            RC_CANNOTRECEIVE    System cannot currently receive
-                                messages.  This will be returned only
-                                after the receive queue is empty.
+Parameters:    unsigned char    Nonzero to return the location to the
+                                free list
+Return:        unsigned char    The location that was unlinked
 *********************************************************************/
-unsigned char J1939_DequeueMessage( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+unsigned char TXBinPop( unsigned char Release )
 {
-    unsigned char    rc = RC_SUCCESS;
+    unsigned char Bin;
+    unsigned char Slot;
 
-    #ifndef J1939_POLL_MCP
-        INTE = 0;
-    #endif
+    Slot = TXHead;
+    Bin = TX_MSG(Slot)->Msg.Priority;
+    TXBinHead[Bin] = TXNext[Slot];
+    if (Release)
+    {
+        TXNext[Slot] = TXFree;
+        TXFree = Slot;
+    }
+    TXQueueCount --;
 
-    if (RXQueueCount == 0)
+    TXHead = TX_NO_SLOT;
+    for ( ; Bin < 8; Bin++)
     {
-        if (J1939_Flags.Flags.CannotClaimAddress)
-            rc = RC_CANNOTRECEIVE;
-        else
-            rc = RC_QUEUEEMPTY;
+        if (TXBinHead[Bin] != TX_NO_SLOT)
+        {
+            TXHead = TXBinHead[Bin];
+            break;
+        }
     }
+    return Slot;
+}
+
+/*********************************************************************
+TXBinDropLast
+
+This routine is used when the transmit queue is full and can be
+overwritten.  The newest message in the least urgent bin is dropped, and
+its location is returned for the new message.
+
+Parameters:    None
+Return:        unsigned char    The location that was unlinked
+*********************************************************************/
+unsigned char TXBinDropLast( void )
+{
+    unsigned char Bin;
+    unsigned char Slot;
+
+    Bin = 8;
+    while (TXBinHead[--Bin] == TX_NO_SLOT);
+
+    Slot = TXBinHead[Bin];
+    if (Slot == TXBinTail[Bin])
+        TXBinHead[Bin] = TX_NO_SLOT;
     else
     {
-        *MsgPtr = RXQueue[RXHead];
-        RXHead ++;
-        if (RXHead >= J1939_RX_QUEUE_SIZE)
-            RXHead = 0;
-        RXQueueCount --;
+        while (TXNext[Slot] != TXBinTail[Bin])
+            Slot = TXNext[Slot];
+        TXBinTail[Bin] = Slot;
+        Slot = TXNext[Slot];
+        TXNext[TXBinTail[Bin]] = TX_NO_SLOT;
     }
+    TXQueueCount --;
 
-    #ifndef J1939_POLL_MCP
-        INTE = 1;
-    #endif
-
-    return rc;
+    // If that was the only message, the queue is empty now.
+    if (Slot == TXHead)
+        TXHead = TX_NO_SLOT;
+    return Slot;
 }
+#endif
 
 /*********************************************************************
-J1939_EnqueueMessage
+RXQueueAdd
 
-This routine takes a message from the caller's buffer and places it in
-the transmit queue.  If the message cannot be queued or sent, an appropriate
-return code is returned.  If interrupts are being used, then the
-transmit interrupt is enabled after the message is queued.
+This routine stores the message in OneMessage in the receive queue.  If
+the queue is full, the last location is overwritten if that's allowed.
 
-Parameters:    J1939_MESSAGE *        Pointer to the caller's message buffer
-Return:        RC_SUCCESS            Message dequeued successfully
-            RC_QUEUEFULL        Transmit queue full; message not queued
-            RC_CANNOTTRANSMIT    System cannot currently transmit
-                                messages.
+With a compact receive queue, the message is stored as its header
+followed by only the data bytes it uses.  If the record doesn't fit in
+the space left at the end of the queue, that space is skipped and the
+record goes at the front, if there is room before RXHead.
+
+Parameters:    None
+Return:        RC_SUCCESS            Message queued successfully
+            RC_QUEUEFULL        No room; message not queued
 *********************************************************************/
-unsigned char J1939_EnqueueMessage( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+#ifndef J1939_COMPACT_RX_QUEUE
+unsigned char RXQueueAdd( void )
 {
-    unsigned char    rc = RC_SUCCESS;
+    if ((RXQueueCount >= RX_QUEUE_LENGTH) && !RX_CAN_OVERWRITE)
+        return RC_QUEUEFULL;
 
-    #ifndef J1939_POLL_MCP
-        INTE = 0;
+    #ifdef J1939_LOCK_FREE_QUEUES
+        *RX_MSG(RX_SLOT(RXTail)) = OneMessage;
+        RXTail ++;
+    #else
+        if (RXQueueCount < RX_QUEUE_LENGTH)
+        {
+            RXQueueCount ++;
+            RXTail ++;
+            if (RXTail >= RX_QUEUE_LENGTH)
+                RXTail = 0;
+        }
+        else
+            STAT_COUNT( RXDropped );
+        *RX_MSG(RXTail) = OneMessage;
     #endif
+    STAT_HIGH_WATER( RXHighWater, RXQueueCount );
+    return RC_SUCCESS;
+}
+#else
+unsigned char RXQueueAdd( void )
+{
+    unsigned char    Length;
+    unsigned char    Loop;
 
-    if (J1939_Flags.Flags.CannotClaimAddress)
-        rc = RC_CANNOTTRANSMIT;
-    else
+    Length = J1939_MSG_LENGTH + OneMessage.Msg.DataLength;
+    if ((RXQueueCount != 0) && (RXTail <= RXHead))
     {
-        if ((TXQueueCount < J1939_TX_QUEUE_SIZE) ||
-             (J1939_OVERWRITE_TX_QUEUE == J1939_TRUE))
+        // The records have already wrapped, so the room is before RXHead.
+        if (RXTail + Length > RXHead)
+            return RC_QUEUEFULL;
+    }
+    else if (RXTail + Length > RX_QUEUE_BYTES)
+    {
+        if (Length > RXHead)
+            return RC_QUEUEFULL;
+        RXEnd = RXTail;
+        RXTail = 0;
+    }
+
+    for (Loop=0; Loop<Length; Loop++)
+        RXQueue[RXTail++] = OneMessage.Array[Loop];
+    RXQueueCount ++;
+    STAT_HIGH_WATER( RXHighWater, RXQueueCount );
+    return RC_SUCCESS;
+}
+
+/*********************************************************************
+RXQueueTake
+
+This routine removes the oldest record from the compact receive queue,
+copying it to the caller's buffer first if a buffer is given.  Only the
+data bytes the message uses are copied.  When the queue empties, it
+starts over at the front, so the next records have the most room.  This
+must be called with interrupts disabled.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message
+                                buffer, or 0 to discard the message
+Return:        None
+*********************************************************************/
+void RXQueueTake( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+    unsigned char    Length;
+    unsigned char    Loop;
+
+    Length = J1939_MSG_LENGTH +
+        ((J1939_RX_QUEUE_BANK J1939_MESSAGE *) &(RXQueue[RXHead]))->Msg.DataLength;
+    if (MsgPtr != 0)
+    {
+        for (Loop=0; Loop<Length; Loop++)
+            MsgPtr->Array[Loop] = RXQueue[RXHead+Loop];
+    }
+    RXHead += Length;
+
+    RXQueueCount --;
+    if (RXQueueCount == 0)
+    {
+        RXHead = 0;
+        RXTail = 0;
+        RXEnd = RX_QUEUE_BYTES;
+    }
+    else if (RXHead >= RXEnd)
+    {
+        RXHead = 0;
+        RXEnd = RX_QUEUE_BYTES;
+    }
+}
+#endif
+
+/*********************************************************************
+MailboxStore
+
+This routine is called by J1939_ReceiveMessages with a broadcast
+message in OneMessage.  If a mailbox is open for the message's PGN and
+source address, the message replaces the one in the mailbox.
+
+Parameters:    None
+Return:        1 if the message was put in a mailbox, 0 if not
+*********************************************************************/
+#ifdef J1939_MAILBOX_SIZE
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+unsigned char MailboxStore( void )
+{
+    unsigned char    Box;
+
+    for (Box=0; Box<J1939_MAILBOX_SIZE; Box++)
+    {
+        if ((MailboxState[Box] != MAILBOX_CLOSED) &&
+            (Mailbox[Box].Msg.PDUFormat == OneMessage.Msg.PDUFormat) &&
+            (Mailbox[Box].Msg.GroupExtension == OneMessage.Msg.GroupExtension) &&
+            (Mailbox[Box].Msg.DataPage == OneMessage.Msg.DataPage) &&
+            ((MailboxSource[Box] == J1939_GLOBAL_ADDRESS) ||
+             (MailboxSource[Box] == OneMessage.Msg.SourceAddress)))
+        {
+            Mailbox[Box] = OneMessage;
+            MailboxState[Box] = MAILBOX_NEW;
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*********************************************************************
+FindSubscribedPGN
+
+This routine does a binary search of the subscribed PGN table.
+
+Parameters:    unsigned char    PDU Format
+            unsigned char    Group Extension
+Return:        unsigned char    Location of the PGN in the table, or the
+                                location where it belongs if it isn't
+                                there
+*********************************************************************/
+#ifdef J1939_GE_SUBSCRIPTIONS
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+unsigned char FindSubscribedPGN( unsigned char PDUFormat, unsigned char GroupExtension )
+{
+    unsigned char    Low;
+    unsigned char    High;
+    unsigned char    Middle;
+
+    Low = 0;
+    High = SubscribedPGNCount;
+    while (Low < High)
+    {
+        Middle = (Low + High) >> 1;
+        if ((SubscribedPGNPF[Middle] < PDUFormat) ||
+            ((SubscribedPGNPF[Middle] == PDUFormat) &&
+             (SubscribedPGNGE[Middle] < GroupExtension)))
+            Low = Middle + 1;
+        else
+            High = Middle;
+    }
+    return Low;
+}
+#endif
+
+/*********************************************************************
+Subscribed
+
+This routine checks whether the CA has subscribed to the message in
+OneMessage, either to its whole PDU Format or to its single PGN.
+
+Parameters:    None
+Return:        1 if the message should be kept, 0 if not
+*********************************************************************/
+#ifdef J1939_SUBSCRIPTIONS
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+unsigned char Subscribed( void )
+{
+    unsigned char    PDUFormat;
+    #ifdef J1939_GE_SUBSCRIPTIONS
+    unsigned char    Slot;
+    #endif
+
+    PDUFormat = OneMessage.Msg.PDUFormat;
+    if (SubscribedPF[PDUFormat >> 3] & (1 << (PDUFormat & 0x07)))
+        return 1;
+
+    #ifdef J1939_GE_SUBSCRIPTIONS
+    if ((PDUFormat >= J1939_PF_FIRST_BROADCAST) &&
+        (SubscribedGE[(PDUFormat >> 3) & 0x01] & (1 << (PDUFormat & 0x07))))
+    {
+        Slot = FindSubscribedPGN( PDUFormat, OneMessage.Msg.GroupExtension );
+        if ((Slot < SubscribedPGNCount) &&
+            (SubscribedPGNPF[Slot] == PDUFormat) &&
+            (SubscribedPGNGE[Slot] == OneMessage.Msg.GroupExtension))
+            return 1;
+    }
+    #endif
+    return 0;
+}
+#endif
+
+/*********************************************************************
+TXQueueAdd
+
+This routine copies a message from the caller's buffer into the
+transmit queue and converts it for the MCP2515.  If the queue is full,
+the caller must already have checked that it may be overwritten.  Unless
+the queues are lock-free, this must be called with interrupts disabled.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message buffer
+Return:        None
+*********************************************************************/
+void TXQueueAdd( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+#ifdef J1939_TX_PRIORITY_BINS
+    unsigned char    Slot;
+
+    if (!TX_QUEUE_FULL)
+    {
+        Slot = TXFree;
+        TXFree = TXNext[Slot];
+    }
+    else
+    {
+        Slot = TXBinDropLast();
+        STAT_COUNT( TXDropped );
+    }
+    *TX_MSG(Slot) = *MsgPtr;
+    EncodeMessage( TX_MSG(Slot) );
+    TXBinPush( Slot, 0 );
+#else
+#ifdef J1939_LOCK_FREE_QUEUES
+    *TX_MSG(TX_SLOT(TXTail)) = *MsgPtr;
+    EncodeMessage( TX_MSG(TX_SLOT(TXTail)) );
+    TXTail ++;
+#else
+    if (TXQueueCount < TX_QUEUE_LENGTH)
+    {
+        TXQueueCount ++;
+        TXTail ++;
+        if (TXTail >= TX_QUEUE_LENGTH)
+            TXTail = 0;
+    }
+    else
+        STAT_COUNT( TXDropped );
+    *TX_MSG(TXTail) = *MsgPtr;
+    EncodeMessage( TX_MSG(TXTail) );
+#endif
+#endif
+    STAT_HIGH_WATER( TXHighWater, TXQueueCount );
+}
+
+/*********************************************************************
+TXQueueReplace
+
+This routine looks for a message waiting in the transmit queue with the
+same PGN and destination as the caller's message.  If there is one, its
+data is replaced with the caller's, so stale data never goes out and the
+queue doesn't fill up with copies.  With priority bins, only the bin for
+the caller's priority is searched.  Only broadcast PGNs are replaced.
+A message to one destination may be a request, an acknowledgment, or a
+transport protocol packet, where each copy carries something different,
+so it is always queued.  This must be called with interrupts disabled.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message buffer
+Return:        1 if a waiting message was replaced, 0 if not
+*********************************************************************/
+#ifdef J1939_REPLACE_TX_MESSAGES
+unsigned char TXQueueReplace( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+    unsigned char    Loop;
+    unsigned char    PDUFormat;
+    unsigned char    Slot;
+    J1939_TX_QUEUE_BANK J1939_MESSAGE *QueuePtr;
+
+    if (MsgPtr->Msg.PDUFormat < J1939_PF_FIRST_BROADCAST)
+        return 0;
+
+    // The queued messages are already encoded, so encode the caller's
+    // PDU Format the same way to compare it.
+    PDUFormat = ((MsgPtr->Msg.PDUFormat & 0x1C) << 3) |
+                (MsgPtr->Msg.PDUFormat & 0x03) | 0x08;
+
+#ifdef J1939_TX_PRIORITY_BINS
+    for (Slot = TXBinHead[MsgPtr->Msg.Priority]; Slot != TX_NO_SLOT; Slot = TXNext[Slot])
+#else
+    Slot = TXHead;
+    for (Loop = TXQueueCount; Loop != 0; Loop--)
+#endif
+    {
+        QueuePtr = TX_MSG(Slot);
+        if ((QueuePtr->Msg.PDUFormat == PDUFormat) &&
+            (QueuePtr->Msg.PDUFormat_Top == (MsgPtr->Msg.PDUFormat >> 5)) &&
+            (QueuePtr->Msg.PDUSpecific == MsgPtr->Msg.PDUSpecific) &&
+            (QueuePtr->Msg.DataPage == MsgPtr->Msg.DataPage))
+            goto Replace;
+    #ifndef J1939_TX_PRIORITY_BINS
+        Slot ++;
+        if (Slot >= TX_QUEUE_LENGTH)
+            Slot = 0;
+    #endif
+    }
+    return 0;
+
+Replace:
+    QueuePtr->Msg.DataLength = MsgPtr->Msg.DataLength;
+    if (QueuePtr->Msg.DataLength > 8)
+        QueuePtr->Msg.DataLength = 8;
+    for (Loop=0; Loop<QueuePtr->Msg.DataLength; Loop++)
+        QueuePtr->Msg.Data[Loop] = MsgPtr->Msg.Data[Loop];
+    return 1;
+}
+#endif
+
+/*********************************************************************
+EnableTransmitInterrupts
+
+This routine enables the MCP2515 interrupts on the transmit queue
+buffers.  J1939_TransmitMessages disables them again once the queue is
+empty.  TransmitInterruptsEnabled follows the CANINTE bits, so the SPI
+command is only sent when they are actually off.  Unless the queues are
+lock-free, this must be called with interrupts disabled.  With lock-free
+queues, interrupts are disabled here only while the SPI port is in use,
+and only after the message has been put in the queue.  If the interrupt
+routine has already emptied the queue by then, the interrupts are left
+off, since a finished buffer would otherwise hold the INT pin low with
+nothing to send.
+
+Parameters:    None
+Return:        None
+*********************************************************************/
+#ifndef J1939_POLL_MCP
+void EnableTransmitInterrupts( void )
+{
+    if (J1939_Flags.Flags.TransmitInterruptsEnabled)
+        return;
+
+    #ifdef J1939_LOCK_FREE_QUEUES
+        INTE = 0;
+        if (TXQueueCount == 0)
+            goto Done;
+    #endif
+
+    SELECT_MCP;
+    #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+        WRITESPI( MCP_BITMOD );
+        WRITESPI( MCP_CANINTE );
+        WRITESPI( TX_INT_MASK );
+        WRITESPI( TX_INT_MASK );
+    #else
+        WriteSPI( MCP_BITMOD );
+        WriteSPI( MCP_CANINTE );
+        WriteSPI( TX_INT_MASK );
+        WriteSPI( TX_INT_MASK );
+    #endif
+    UNSELECT_MCP;
+    J1939_Flags.Flags.TransmitInterruptsEnabled = 1;
+
+#ifdef J1939_LOCK_FREE_QUEUES
+Done:
+    INTE = 1;
+#endif
+}
+#endif
+
+/*********************************************************************
+PreemptTransmitBuffer
+
+This routine is called when the message at the head of the transmit
+queue cannot be loaded.  If its J1939 priority is higher than that of
+every message waiting in the transmit buffers, a buffer is made
+available for it.  A free buffer is used if there is one.  Otherwise,
+the least urgent message (the latest one loaded, if there is a tie) is
+aborted.  If the abort works, that message is read back and put at the
+head of the queue (or of its bin), so it will be sent again later.  If it was already
+on its way out, it is simply allowed to finish.  The MCP2515 is asked
+only J1939_TX_PREEMPT_WAIT times whether it has let go of the buffer,
+since this runs from the interrupt routine.  If the message is still
+going out after that, the urgent message waits for the next transmit
+interrupt.
+
+The urgent message is removed from the queue and left in OneMessage,
+and the caller must send it as an express message in the buffer that
+is returned.
+
+Parameters:    None
+Return:        READ STATUS transmit request bit of the buffer to use,
+            or 0 if the message at the head of the queue must wait
+*********************************************************************/
+#ifdef J1939_TX_PREEMPTION
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+unsigned char PreemptTransmitBuffer( void )
+{
+    unsigned char Buffer;
+    unsigned char Free;
+    unsigned char Loop;
+    unsigned char Mask;
+    unsigned char Priority;
+    unsigned char Slot;
+    unsigned char Status;
+    unsigned char Victim;
+
+    Priority = TX_MSG(TX_HEAD)->Msg.Priority;
+
+    SELECT_MCP;
+    #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+        WRITESPI( MCP_READ_STATUS );
+        READSPI( Status );
+    #else
+        WriteSPI( MCP_READ_STATUS );
+        Status = ReadSPI();
+    #endif
+    UNSELECT_MCP;
+
+    // Every message in our buffers must be less urgent (a higher
+    // priority value).  Pick the victim along the way.
+    Free = 0;
+    Victim = 0xFF;
+    Mask = MCP_STAT_TX0REQ;
+    for (Buffer = 0; Buffer < 3; Buffer++)
+    {
+        if (APP_TX_MASK & Mask)
+        {
+            if (!(Status & Mask))
+                Free = Mask;
+            else if (TXPriority[Buffer] <= Priority)
+                return 0;
+            else if ((Victim == 0xFF) ||
+                     (TXPriority[Buffer] > TXPriority[Victim]) ||
+                     ((TXPriority[Buffer] == TXPriority[Victim]) &&
+                      (TXKey[Buffer] < TXKey[Victim])))
+                Victim = Buffer;
+        }
+        Mask <<= 2;
+    }
+
+    if (Free == 0)
+    {
+        // Clear the victim's transmit request, and wait a little for the
+        // MCP2515 to let go of the buffer.
+        Free = MCP_STAT_TX0REQ << (Victim << 1);
+        Victim = MCP_TXB0CTRL + (Victim << 4);
+        SELECT_MCP;
+        #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+            WRITESPI( MCP_BITMOD );
+            WRITESPI( Victim );
+            WRITESPI( MCP_TXB_TXREQ );
+            WRITESPI( 0 );
+        #else
+            WriteSPI( MCP_BITMOD );
+            WriteSPI( Victim );
+            WriteSPI( MCP_TXB_TXREQ );
+            WriteSPI( 0 );
+        #endif
+        UNSELECT_MCP;
+
+        for (Loop = J1939_TX_PREEMPT_WAIT; Loop != 0; Loop--)
+        {
+            SELECT_MCP;
+            #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+                WRITESPI( MCP_READ );
+                WRITESPI( Victim );
+                READSPI( Status );
+            #else
+                WriteSPI( MCP_READ );
+                WriteSPI( Victim );
+                Status = ReadSPI();
+            #endif
+            UNSELECT_MCP;
+            if (!(Status & MCP_TXB_TXREQ))
+                break;
+        }
+
+        // If it's still being sent, it's already on the bus, so let it
+        // finish.  The urgent message goes out after it.
+        if (Status & MCP_TXB_TXREQ)
+            return 0;
+
+        if (Status & MCP_TXB_ABTF)
+        {
+            // Swap the two messages.  The aborted one is still encoded,
+            // so it can be read straight back into the queue.
+            OneMessage = *TX_MSG(TX_HEAD);
+            #ifdef J1939_TX_PRIORITY_BINS
+                Slot = TXBinPop( 0 );
+            #else
+                Slot = TX_HEAD;
+            #endif
+            SELECT_MCP;
+            #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+                WRITESPI( MCP_READ );
+                WRITESPI( Victim + 1 );
+                for (Loop=0; Loop<J1939_MSG_LENGTH; Loop++)
+                    READSPI( TX_MSG(Slot)->Array[Loop] );
+                for (Loop=0; Loop<TX_MSG(Slot)->Msg.DataLength; Loop++)
+                    READSPI( TX_MSG(Slot)->Msg.Data[Loop] );
+            #else
+                WriteSPI( MCP_READ );
+                WriteSPI( Victim + 1 );
+                for (Loop=0; Loop<J1939_MSG_LENGTH; Loop++)
+                    TX_MSG(Slot)->Array[Loop] = ReadSPI();
+                for (Loop=0; Loop<TX_MSG(Slot)->Msg.DataLength; Loop++)
+                    TX_MSG(Slot)->Msg.Data[Loop] = ReadSPI();
+            #endif
+            UNSELECT_MCP;
+            #ifdef J1939_TX_PRIORITY_BINS
+                TXBinPush( Slot, 1 );
+            #endif
+            return Free;
+        }
+    }
+
+    OneMessage = *TX_MSG(TX_HEAD);
+    #ifdef J1939_TX_PRIORITY_BINS
+        TXBinPop( 1 );
+    #else
+        TX_POP;
+    #endif
+    return Free;
+}
+#endif
+
+/*********************************************************************
+BusLoadUpdate
+
+This routine is called from J1939_Poll at the end of each
+J1939_BUS_LOAD_WINDOW, to compare the bits counted in the window with
+the bits the bus could have carried in that time.  If we're using
+interrupts, they are disabled while the count is taken.
+
+Parameters:    None
+Return:        None
+*********************************************************************/
+#ifdef J1939_MEASURE_BUS_LOAD
+void BusLoadUpdate( void )
+{
+    unsigned long    Bits;
+
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+    Bits = BusLoadBits;
+    BusLoadBits = 0;
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
+
+    J1939_BusLoad.Load = Bits * 1000 /
+                            ((unsigned long) BusLoadTime * (J1939_BUS_BIT_RATE / 1000));
+    BusLoadTime = 0;
+    if (J1939_BusLoad.Load > J1939_BusLoad.PeakLoad)
+        J1939_BusLoad.PeakLoad = J1939_BusLoad.Load;
+}
+#endif
+
+/*********************************************************************
+J1939_AddressClaimHandling
+
+This routine is called either when the CA must claim its address on
+the bus or another CA is trying to claim the same address on the bus and
+we must either defend ourself or relinquish the address.  If the CA has
+an address in the proprietary range of 0-127 or 248-253, it can take
+the address immediately.
+
+Parameters:    unsigned char    ADDRESS_CLAIM_RX indicates an Address
+                            Claim message has been received and this
+                            CA must either defend or give up its
+                            address.
+                            ADDRESS_CLAIM_TX indicates that the CA is
+                            initiating a claim to its address.
+Return:        None
+*********************************************************************/
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#endif
+void J1939_AddressClaimHandling( unsigned char Mode )
+{
+    // Get most of the message ready here, since it'll be very similar
+    // for both messages to be sent.  Note that J1939_PF_ADDRESS_CLAIMED
+    // is the same value as J1939_PF_CANNOT_CLAIM_ADDRESS.  We can't copy
+    // the data yet because we might need to look at the old data.
+
+    OneMessage.Msg.Priority = J1939_CONTROL_PRIORITY;
+    OneMessage.Msg.PDUFormat = J1939_PF_ADDRESS_CLAIMED;
+    OneMessage.Msg.DestinationAddress = J1939_GLOBAL_ADDRESS;
+    OneMessage.Msg.DataLength = J1939_DATA_LENGTH;
+
+    if (Mode == ADDRESS_CLAIM_TX)
+        goto SendAddressClaim;
+
+    STAT_COUNT( NMFrames );
+
+    if (OneMessage.Msg.SourceAddress != J1939_Address)
+        return;
+    if (CompareName( OneMessage.Msg.Data ) != -1) // Our CA_Name is not less
+    {
+        // Send Cannot Claim Address message
+        CopyName();
+        OneMessage.Msg.SourceAddress = J1939_NULL_ADDRESS;
+        EncodeMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+        SendNetworkMessage();
+
+        // Set up MCP filter 2 to receive messages sent to the global address
+        SetAddressFilter( J1939_GLOBAL_ADDRESS );
+
+        J1939_Flags.Flags.CannotClaimAddress = 1;
+        J1939_Flags.Flags.WaitingForAddressClaimContention = 0;
+        return;
+    }
+
+SendAddressClaim:
+    // Send Address Claim message for CommandedAddress
+    CopyName();
+    OneMessage.Msg.SourceAddress = CommandedAddress;
+    EncodeMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+    SendNetworkMessage();
+
+    if (((CommandedAddress & 0x80) == 0) ||            // Addresses 0-127
+        ((CommandedAddress & 0xF8) == 0xF8))        // Addresses 248-253 (254,255 illegal)
+    {
+        J1939_Flags.Flags.CannotClaimAddress = 0;
+        J1939_Address = CommandedAddress;
+
+        // Set up MCP filter 2 to receive messages sent to this address
+        SetAddressFilter( J1939_Address );
+    }
+    else
+    {
+        // We don't have a proprietary address, so we need to wait.
+         J1939_Flags.Flags.WaitingForAddressClaimContention = 1;
+        ContentionWaitTime = 0;
+    }
+}
+
+/*********************************************************************
+J1939_CommitTxSlot
+
+This routine queues the message that the CA built in the location
+returned by J1939_ReserveTxSlot.  The message is converted for the
+MCP2515 before interrupts are disabled, so only the queue update itself
+is done with interrupts off.  If interrupts are being used, then the
+transmit interrupt is enabled after the message is queued.
+
+Parameters:    None
+Return:        RC_SUCCESS            Message queued successfully
+            RC_CANNOTTRANSMIT    System cannot currently transmit
+                                messages.  The location is released.
+            RC_PARAMERROR        No location was reserved
+*********************************************************************/
+unsigned char J1939_CommitTxSlot( void )
+{
+    unsigned char    rc = RC_SUCCESS;
+
+    if (TXReserved == TX_NO_SLOT)
+        return RC_PARAMERROR;
+
+    EncodeMessage( TX_MSG(TXReserved) );
+
+    LOCK_QUEUES;
+
+    if (J1939_Flags.Flags.CannotClaimAddress)
+    {
+        rc = RC_CANNOTTRANSMIT;
+        #ifdef J1939_TX_PRIORITY_BINS
+            TXNext[TXReserved] = TXFree;
+            TXFree = TXReserved;
+        #endif
+    }
+    else
+    {
+        #ifdef J1939_TX_PRIORITY_BINS
+            TXBinPush( TXReserved, 0 );
+        #else
+        #ifdef J1939_LOCK_FREE_QUEUES
+            TXTail ++;
+        #else
+            TXTail = TXReserved;
+            TXQueueCount ++;
+        #endif
+        #endif
+        STAT_HIGH_WATER( TXHighWater, TXQueueCount );
+
+        #ifndef J1939_POLL_MCP
+            EnableTransmitInterrupts();
+        #endif
+    }
+    TXReserved = TX_NO_SLOT;
+
+    UNLOCK_QUEUES;
+
+    return rc;
+}
+
+/*********************************************************************
+J1939_DequeueMessage
+
+This routine takes a message from the receive queue and places it in
+the caller's buffer.  If there is no message to return, an appropriate
+return code is returned.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message buffer
+Return:        RC_SUCCESS            Message dequeued successfully
+            RC_QUEUEEMPTY        No messages to return
+            RC_CANNOTRECEIVE    System cannot currently receive
+                                messages.  This will be returned only
+                                after the receive queue is empty.
+*********************************************************************/
+unsigned char J1939_DequeueMessage( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+    unsigned char    rc = RC_SUCCESS;
+
+    LOCK_QUEUES;
+
+    if (RXQueueCount == 0)
+    {
+        if (J1939_Flags.Flags.CannotClaimAddress)
+            rc = RC_CANNOTRECEIVE;
+        else
+            rc = RC_QUEUEEMPTY;
+    }
+    else
+    {
+    #ifdef J1939_COMPACT_RX_QUEUE
+        RXQueueTake( MsgPtr );
+    #else
+        *MsgPtr = *RX_MSG(RX_HEAD);
+        RX_POP;
+    #endif
+    }
+
+    UNLOCK_QUEUES;
+
+    return rc;
+}
+
+/*********************************************************************
+J1939_DequeueMessages
+
+This routine is like J1939_DequeueMessage, but it moves up to Count
+messages from the receive queue into an array in the caller's buffer
+with interrupts disabled only once.  Unless the queues are lock-free,
+interrupts stay disabled while the messages are copied, so keep the
+batches short.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message array
+            unsigned char        Number of messages the array can hold
+Return:        unsigned char        Number of messages dequeued.  If this
+                                is 0, see J1939_DequeueMessage for the
+                                reason.
+*********************************************************************/
+unsigned char J1939_DequeueMessages( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr, unsigned char Count )
+{
+    unsigned char    Moved = 0;
+
+    LOCK_QUEUES;
+
+    while ((Moved < Count) && (RXQueueCount != 0))
+    {
+    #ifdef J1939_COMPACT_RX_QUEUE
+        RXQueueTake( &(MsgPtr[Moved]) );
+    #else
+        MsgPtr[Moved] = *RX_MSG(RX_HEAD);
+        RX_POP;
+    #endif
+        Moved ++;
+    }
+
+    UNLOCK_QUEUES;
+
+    return Moved;
+}
+
+/*********************************************************************
+J1939_EnqueueMessage
+
+This routine takes a message from the caller's buffer and places it in
+the transmit queue.  If the message cannot be queued or sent, an appropriate
+return code is returned.  If interrupts are being used, then the
+transmit interrupt is enabled after the message is queued.
+
+With J1939_REPLACE_TX_MESSAGES, a message with the same PGN and
+destination that is still waiting in the queue gets the new data
+instead, and RC_SUCCESS is returned even if the queue is full.
+
+Unless the queue is kept in priority bins, a location reserved with
+J1939_ReserveTxSlot holds the tail of the queue, so no other message can
+be queued until it is committed.  That isn't an overflow, so it isn't
+counted in TXRejected.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message buffer
+Return:        RC_SUCCESS            Message dequeued successfully
+            RC_QUEUEFULL        Transmit queue full, or the tail is
+                                reserved with J1939_ReserveTxSlot;
+                                message not queued
+            RC_CANNOTTRANSMIT    System cannot currently transmit
+                                messages.
+*********************************************************************/
+unsigned char J1939_EnqueueMessage( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+    unsigned char    rc = RC_SUCCESS;
+
+    LOCK_QUEUES;
+
+    if (J1939_Flags.Flags.CannotClaimAddress)
+        rc = RC_CANNOTTRANSMIT;
+#ifdef J1939_REPLACE_TX_MESSAGES
+    else if (TXQueueReplace( MsgPtr ))
+        rc = RC_SUCCESS;    // The waiting message already has interrupts on.
+#endif
+#ifndef J1939_TX_PRIORITY_BINS
+    else if (TXReserved != TX_NO_SLOT)
+        rc = RC_QUEUEFULL;
+#endif
+    else
+    {
+        // With bins, a reserved location may have taken the last free
+        // one, and then there is nothing to overwrite if the queue is
+        // empty.
+        if (!TX_QUEUE_FULL ||
+            ((J1939_OVERWRITE_TX_QUEUE == J1939_TRUE) && (TXQueueCount != 0)))
         {
-            if (TXQueueCount < J1939_TX_QUEUE_SIZE)
-            {
-                TXQueueCount ++;
-                TXTail ++;
-                if (TXTail >= J1939_TX_QUEUE_SIZE)
-                    TXTail = 0;
-            }
-            TXQueue[TXTail] = *MsgPtr;
+            TXQueueAdd( MsgPtr );
 
             #ifndef J1939_POLL_MCP
-                // Enable the transmit interrupts on TXB0 and TXB1
-                SELECT_MCP;
-                #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-                    WRITESPI( MCP_BITMOD );
-                    WRITESPI( MCP_CANINTE );
-                    WRITESPI( MCP_TX_INT );
-                    WRITESPI( MCP_TX01_INT );
-                #else
-                    WriteSPI( MCP_BITMOD );
-                    WriteSPI( MCP_CANINTE );
-                    WriteSPI( MCP_TX_INT );
-                    WriteSPI( MCP_TX01_INT );
-                #endif
-                UNSELECT_MCP;
+                EnableTransmitInterrupts();
             #endif
         }
         else
+        {
             rc = RC_QUEUEFULL;
+            STAT_COUNT( TXRejected );
+        }
 
     }
 
-    #ifndef J1939_POLL_MCP
-        INTE = 1;
-    #endif
+    UNLOCK_QUEUES;
 
     return rc;
 }
 
+/*********************************************************************
+J1939_EnqueueMessages
+
+This routine is like J1939_EnqueueMessage, but it takes up to Count
+messages from an array in the caller's buffer.  Interrupts are disabled
+once for the whole batch, and the transmit interrupt is enabled once at
+the end, so it is cheaper than calling J1939_EnqueueMessage for each
+message.  Unless the queues are lock-free, interrupts stay disabled
+while the messages are copied, so keep the batches short.
+
+Parameters:    J1939_MESSAGE *        Pointer to the caller's message array
+            unsigned char        Number of messages in the array
+Return:        unsigned char        Number of messages queued.  If this is
+                                less than Count, the rest were not
+                                queued; see J1939_EnqueueMessage.
+*********************************************************************/
+unsigned char J1939_EnqueueMessages( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr, unsigned char Count )
+{
+    unsigned char    Queued = 0;
+
+    LOCK_QUEUES;
+
+#ifdef J1939_TX_PRIORITY_BINS
+    if (!J1939_Flags.Flags.CannotClaimAddress)
+#else
+    if (!J1939_Flags.Flags.CannotClaimAddress && (TXReserved == TX_NO_SLOT))
+#endif
+    {
+        while (Queued < Count)
+        {
+        #ifdef J1939_REPLACE_TX_MESSAGES
+            if (!TXQueueReplace( &(MsgPtr[Queued]) ))
+        #endif
+            {
+                if (TX_QUEUE_FULL &&
+                    ((J1939_OVERWRITE_TX_QUEUE == J1939_FALSE) || (TXQueueCount == 0)))
+                    break;
+                TXQueueAdd( &(MsgPtr[Queued]) );
+            }
+            Queued ++;
+        }
+
+        #ifndef J1939_POLL_MCP
+            if (Queued != 0)
+                EnableTransmitInterrupts();
+        #endif
+        #ifdef J1939_COLLECT_STATISTICS
+            J1939_Statistics.TXRejected += Count - Queued;
+        #endif
+    }
+
+    UNLOCK_QUEUES;
+
+    return Queued;
+}
+
 /*********************************************************************
 J1939_Initialization
 
@@ -581,13 +1882,64 @@ void J1939_Initialization( void )
     // Initialize global variables;
     J1939_Flags.FlagVal = 1;    // Cannot Claim Address, all other flags cleared.
     ContentionWaitTime = 0;
+    #ifdef J1939_COLLECT_STATISTICS
+        for (i = 0; i < sizeof(J1939_STATISTICS); i++)
+            ((unsigned char *) &J1939_Statistics)[i] = 0;
+    #endif
+    #ifdef J1939_MEASURE_BUS_LOAD
+        for (i = 0; i < sizeof(J1939_BUS_LOAD); i++)
+            ((unsigned char *) &J1939_BusLoad)[i] = 0;
+        BusLoadBits = 0;
+        BusLoadTime = 0;
+    #endif
     CommandedAddress = J1939_Address = J1939_STARTING_ADDRESS;
-    TXHead = 0;
-    TXTail = 0xFF;
-    TXQueueCount = 0;
-    RXHead = 0;
-    RXTail = 0xFF;
-    RXQueueCount = 0;
+    TXReserved = TX_NO_SLOT;
+    #ifdef J1939_LOCK_FREE_QUEUES
+        TXHead = 0;
+        TXTail = 0;
+        RXHead = 0;
+        RXTail = 0;
+    #else
+        TXQueueCount = 0;
+        #ifdef J1939_TX_PRIORITY_BINS
+            TXHead = TX_NO_SLOT;
+            for (i = 0; i < 8; i++)
+                TXBinHead[i] = TX_NO_SLOT;
+            for (i = 0; i < TX_QUEUE_LENGTH; i++)
+                TXNext[i] = i + 1;
+            TXNext[TX_QUEUE_LENGTH-1] = TX_NO_SLOT;
+            TXFree = 0;
+        #else
+            TXHead = 0;
+            TXTail = 0xFF;
+        #endif
+        RXHead = 0;
+        #ifdef J1939_COMPACT_RX_QUEUE
+            RXTail = 0;
+            RXEnd = RX_QUEUE_BYTES;
+        #else
+            RXTail = 0xFF;
+        #endif
+        RXQueueCount = 0;
+    #endif
+    #ifdef J1939_MAILBOX_SIZE
+        for (i = 0; i < J1939_MAILBOX_SIZE; i++)
+            MailboxState[i] = MAILBOX_CLOSED;
+    #endif
+    #ifdef J1939_SUBSCRIPTIONS
+        for (i = 0; i < 32; i++)
+            SubscribedPF[i] = 0;
+    #endif
+    #ifdef J1939_GE_SUBSCRIPTIONS
+        SubscribedGE[0] = 0;
+        SubscribedGE[1] = 0;
+        SubscribedPGNCount = 0;
+    #endif
+    #ifdef J1939_NM_TX_LANE
+        NMHead = 0;
+        NMTail = 0xFF;
+        NMQueueCount = 0;
+    #endif
     CA_Name[7] = J1939_CA_NAME7;
     CA_Name[6] = J1939_CA_NAME6;
     CA_Name[5] = J1939_CA_NAME5;
@@ -689,81 +2041,335 @@ flag is set.  First we'll clear the interrupt flag.  Then we'll call
 the receive and transmit functions to process any received messages and
 to transmit any messages in the transmit queue.
 
-Parameters:    None
+Parameters:    None
+Return:        None
+*********************************************************************/
+#ifndef J1939_POLL_MCP
+#pragma interrupt_level 0
+#pragma inline J1939_ISR
+void J1939_ISR( void )
+{
+    INTF = 0;
+
+    J1939_ReceiveMessages();
+    J1939_TransmitMessages();
+}
+#endif
+
+/*********************************************************************
+J1939_OpenMailbox
+
+This routine sets up a mailbox to keep the newest message with the
+DataPage, PDUFormat, and GroupExtension of the caller's message.  If
+its SourceAddress is the global address, messages from any source are
+kept.  Otherwise, only messages from that source are kept.  Any message
+already in the mailbox is discarded.  If we're using interrupts, they
+are disabled while the mailbox changes.
+
+Parameters:    unsigned char        Mailbox number
+            J1939_MESSAGE *        Pointer to a message with the PGN and
+                                source address to keep
+Return:        RC_SUCCESS            Mailbox opened successfully
+            RC_PARAMERROR        Invalid mailbox number, or the PGN is
+                                not a broadcast PGN
+*********************************************************************/
+#ifdef J1939_MAILBOX_SIZE
+unsigned char J1939_OpenMailbox( unsigned char Box, J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+    if ((Box >= J1939_MAILBOX_SIZE) ||
+        (MsgPtr->Msg.PDUFormat < J1939_PF_FIRST_BROADCAST))
+        return RC_PARAMERROR;
+
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+
+    Mailbox[Box].Msg.DataPage = MsgPtr->Msg.DataPage;
+    Mailbox[Box].Msg.PDUFormat = MsgPtr->Msg.PDUFormat;
+    Mailbox[Box].Msg.GroupExtension = MsgPtr->Msg.GroupExtension;
+    MailboxSource[Box] = MsgPtr->Msg.SourceAddress;
+    MailboxState[Box] = MAILBOX_READ;
+
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
+
+    return RC_SUCCESS;
+}
+#endif
+
+/*********************************************************************
+J1939_PeekMessage
+
+This routine gives the CA direct access to the oldest message in the
+receive queue, without copying it.  The message stays in the queue, and
+the receive routines will not overwrite it, until the CA calls
+J1939_ReleaseMessage.  Calling this routine again before then returns
+the same message.  Do not mix this with J1939_DequeueMessage.
+
+NOTE: The pointer is to the receive queue bank, not the CA's message
+bank.
+
+Parameters:    None
+Return:        J1939_MESSAGE *        Pointer to the message, or 0 if the
+                                receive queue is empty
+*********************************************************************/
+J1939_RX_QUEUE_BANK J1939_MESSAGE *J1939_PeekMessage( void )
+{
+    // Only the receive routines change RXQueueCount behind our back, and
+    // they never lower it, so we don't need to disable interrupts.
+    if (RXQueueCount == 0)
+        return 0;
+
+    J1939_Flags.Flags.ReceivedMessageHeld = 1;
+    #ifdef J1939_COMPACT_RX_QUEUE
+        return (J1939_RX_QUEUE_BANK J1939_MESSAGE *) &(RXQueue[RXHead]);
+    #else
+        return RX_MSG(RX_HEAD);
+    #endif
+}
+
+/*********************************************************************
+J1939_Poll
+
+If we're polling for messages, then this routine should be called by
+the CA every few milliseconds during CA processing.  The routine receives
+any messages that are waiting and transmits any messages that are queued.
+Then we see if we are waiting for an address contention response.  If
+we are and we've timed out, we accept the address as ours.
+
+If the CA is using interrupts, then this routine should be called by
+the CA every few milliseconds while the WaitingForAddressClaimContention
+flag is set after calling J1939_Initialization.  If the Commanded Address
+message can be accepted, this routine must also be called every few
+milliseconds during CA processing in case we are commanded to change our
+address.  If using interrupts, this routine will not check for received
+or transmit messages; it will only check for a timeout on address
+claim contention.
+
+Parameters:    unsigned char    The number of milliseconds that have
+                            passed since the last time this routine was
+                            called.  This number can be approximate,
+                            and to meet spec, should be rounded down.
+Return:        None
+*********************************************************************/
+void J1939_Poll( unsigned char ElapsedTime )
+{
+    unsigned int    Temp;
+
+    // Update the Contention Wait Time.  We have to do that before
+    // we call J1939_ReceiveMessages in case the time gets reset back
+    // to zero in that routine.
+
+    Temp = ContentionWaitTime + ElapsedTime;
+    if (Temp > 255)
+        Temp = 255;
+    ContentionWaitTime = (unsigned char) Temp;
+
+    #ifdef J1939_MEASURE_BUS_LOAD
+        BusLoadTime += ElapsedTime;
+        if (BusLoadTime >= J1939_BUS_LOAD_WINDOW)
+            BusLoadUpdate();
+    #endif
+
+    #ifdef J1939_POLL_MCP
+        J1939_ReceiveMessages();
+        J1939_TransmitMessages();
+    #endif
+
+    if (J1939_Flags.Flags.WaitingForAddressClaimContention &&
+        (ContentionWaitTime >= 250))
+    {
+        J1939_Flags.Flags.CannotClaimAddress = 0;
+        J1939_Flags.Flags.WaitingForAddressClaimContention = 0;
+        J1939_Address = CommandedAddress;
+
+        // Set up MCP filter 2 to receive messages sent to this address.
+        // If we're using interrupts, make sure that interrupts are disabled
+        // around this section, since it will mess up what we're doing.
+        #ifndef J1939_POLL_MCP
+            INTE = 0;
+        #endif
+        SetAddressFilter( J1939_Address );
+        #ifndef J1939_POLL_MCP
+            INTE = 1;
+        #endif
+    }
+}
+
+/*********************************************************************
+J1939_ReadBusLoad
+
+This routine copies the bus load measurements to the caller's buffer,
+with the MCP2515's error counters as they are now.  If asked to, it
+clears the peak load and the counts, so the CA can measure from a known
+point.  If we're using interrupts, they are disabled around the copy.
+
+Parameters:    J1939_BUS_LOAD *    Pointer to the caller's buffer
+            unsigned char        Nonzero to clear the measurements
+Return:        None
+*********************************************************************/
+#ifdef J1939_MEASURE_BUS_LOAD
+void J1939_ReadBusLoad( J1939_USER_MSG_BANK J1939_BUS_LOAD *LoadPtr, unsigned char Reset )
+{
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+
+    // TEC and REC are next to each other, so one READ gets both.
+    SELECT_MCP;
+    #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+        WRITESPI( MCP_READ );
+        WRITESPI( MCP_TEC );
+        READSPI( J1939_BusLoad.TXErrorCount );
+        READSPI( J1939_BusLoad.RXErrorCount );
+    #else
+        WriteSPI( MCP_READ );
+        WriteSPI( MCP_TEC );
+        J1939_BusLoad.TXErrorCount = ReadSPI();
+        J1939_BusLoad.RXErrorCount = ReadSPI();
+    #endif
+    UNSELECT_MCP;
+
+    *LoadPtr = J1939_BusLoad;
+    if (Reset)
+    {
+        J1939_BusLoad.PeakLoad = J1939_BusLoad.Load;
+        J1939_BusLoad.ArbitrationLost = 0;
+        J1939_BusLoad.TXErrors = 0;
+    }
+
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
+}
+#endif
+
+/*********************************************************************
+J1939_ReadMailbox
+
+This routine copies the message in a mailbox to the caller's buffer,
+if a new one has arrived since the mailbox was last read.  If we're
+using interrupts, they are disabled around the copy.
+
+Parameters:    unsigned char        Mailbox number
+            J1939_MESSAGE *        Pointer to the caller's message buffer
+Return:        RC_SUCCESS            Message copied successfully
+            RC_QUEUEEMPTY        No new message since the last read
+            RC_PARAMERROR        Invalid mailbox number, or the
+                                mailbox is not open
+*********************************************************************/
+#ifdef J1939_MAILBOX_SIZE
+unsigned char J1939_ReadMailbox( unsigned char Box, J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr )
+{
+    unsigned char    rc = RC_SUCCESS;
+
+    if (Box >= J1939_MAILBOX_SIZE)
+        return RC_PARAMERROR;
+
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+
+    if (MailboxState[Box] == MAILBOX_NEW)
+    {
+        *MsgPtr = Mailbox[Box];
+        MailboxState[Box] = MAILBOX_READ;
+    }
+    else if (MailboxState[Box] == MAILBOX_READ)
+        rc = RC_QUEUEEMPTY;
+    else
+        rc = RC_PARAMERROR;
+
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
+
+    return rc;
+}
+#endif
+
+/*********************************************************************
+J1939_ReadStatistics
+
+This routine copies the library's counts to the caller's buffer, and
+clears them if asked to, so the CA can count from a known point.  If
+we're using interrupts, they are disabled around the copy, so the
+counts all go together.  Each count wraps around after 65535, so the CA
+should read them often enough to notice.
+
+Parameters:    J1939_STATISTICS *    Pointer to the caller's buffer
+            unsigned char        Nonzero to clear the counts
 Return:        None
 *********************************************************************/
-#ifndef J1939_POLL_MCP
-#pragma interrupt_level 0
-#pragma inline J1939_ISR
-void J1939_ISR( void )
+#ifdef J1939_COLLECT_STATISTICS
+void J1939_ReadStatistics( J1939_USER_MSG_BANK J1939_STATISTICS *StatPtr, unsigned char Reset )
 {
-    INTF = 0;
+    unsigned char    Loop;
 
-    J1939_ReceiveMessages();
-    J1939_TransmitMessages();
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+
+    *StatPtr = J1939_Statistics;
+    if (Reset)
+    {
+        for (Loop=0; Loop<sizeof(J1939_STATISTICS); Loop++)
+            ((unsigned char *) &J1939_Statistics)[Loop] = 0;
+    }
+
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
 }
 #endif
 
 /*********************************************************************
-J1939_Poll
+ReadReceiveBuffer
 
-If we're polling for messages, then this routine should be called by
-the CA every few milliseconds during CA processing.  The routine receives
-any messages that are waiting and transmits any messages that are queued.
-Then we see if we are waiting for an address contention response.  If
-we are and we've timed out, we accept the address as ours.
+This routine reads the message from the receive buffer selected by the
+READ RX instruction passed in, and formats the PDU Format portion so
+it's easier to work with.
 
-If the CA is using interrupts, then this routine should be called by
-the CA every few milliseconds while the WaitingForAddressClaimContention
-flag is set after calling J1939_Initialization.  If the Commanded Address
-message can be accepted, this routine must also be called every few
-milliseconds during CA processing in case we are commanded to change our
-address.  If using interrupts, this routine will not check for received
-or transmit messages; it will only check for a timeout on address
-claim contention.
+NOTE: The READ RX instruction clears the buffer's receive flag in
+CANINTF when the chip select line is raised, so each message costs a
+single SPI transaction.  Even a READ RX with no data read releases the
+buffer.
 
-Parameters:    unsigned char    The number of milliseconds that have
-                            passed since the last time this routine was
-                            called.  This number can be approximate,
-                            and to meet spec, should be rounded down.
+Parameters:    unsigned char        MCP_READ_RX0 or MCP_READ_RX1
+            J1939_MESSAGE *        Pointer to where to put the message
 Return:        None
 *********************************************************************/
-void J1939_Poll( unsigned char ElapsedTime )
+void ReadReceiveBuffer( unsigned char Command, J1939_RX_QUEUE_BANK J1939_MESSAGE *MsgPtr )
 {
-    unsigned int    Temp;
-
-    // Update the Contention Wait Time.  We have to do that before
-    // we call J1939_ReceiveMessages in case the time gets reset back
-    // to zero in that routine.
-
-    Temp = ContentionWaitTime + ElapsedTime;
-    if (Temp > 255)
-        Temp = 255;
-    ContentionWaitTime = (unsigned char) Temp;
+    unsigned char    Loop;
 
-    #ifdef J1939_POLL_MCP
-        J1939_ReceiveMessages();
-        J1939_TransmitMessages();
+    SELECT_MCP;
+    #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+        WRITESPI( Command );
+        for (Loop=0; Loop<J1939_MSG_LENGTH; Loop++)
+            READSPI( MsgPtr->Array[Loop] );
+        if (MsgPtr->Msg.DataLength > 8)
+            MsgPtr->Msg.DataLength = 8;
+        for (Loop=0; Loop<MsgPtr->Msg.DataLength; Loop++)
+            READSPI( MsgPtr->Msg.Data[Loop] );
+    #else
+        WriteSPI( Command );
+        for (Loop=0; Loop<J1939_MSG_LENGTH; Loop++)
+            MsgPtr->Array[Loop] = ReadSPI();
+        if (MsgPtr->Msg.DataLength > 8)
+            MsgPtr->Msg.DataLength = 8;
+        for (Loop=0; Loop<MsgPtr->Msg.DataLength; Loop++)
+            MsgPtr->Msg.Data[Loop] = ReadSPI();
     #endif
+    UNSELECT_MCP;
+    BUS_LOAD_COUNT( MsgPtr->Msg.DataLength );
 
-    if (J1939_Flags.Flags.WaitingForAddressClaimContention &&
-        (ContentionWaitTime >= 250))
-    {
-        J1939_Flags.Flags.CannotClaimAddress = 0;
-        J1939_Flags.Flags.WaitingForAddressClaimContention = 0;
-        J1939_Address = CommandedAddress;
-
-        // Set up MCP filter 2 to receive messages sent to this address.
-        // If we're using interrupts, make sure that interrupts are disabled
-        // around this section, since it will mess up what we're doing.
-        #ifndef J1939_POLL_MCP
-            INTE = 0;
-        #endif
-        SetAddressFilter( J1939_Address );
-        #ifndef J1939_POLL_MCP
-            INTE = 1;
-        #endif
-    }
+    // Format the PDU Format portion so it's easier to work with.
+    Loop = (MsgPtr->Msg.PDUFormat & 0xE0) >> 3;            // Get SID2-0 ready.
+    MsgPtr->Msg.PDUFormat = (MsgPtr->Msg.PDUFormat & 0x03) |
+                                Loop |
+                                ((MsgPtr->Msg.PDUFormat_Top & 0x07) << 5);
 }
 
 /*********************************************************************
@@ -775,6 +2381,17 @@ If it is a network management message, it is processed.  Otherwise, it
 is placed in the receive queue for the user.  Note that interrupts are
 disabled during this routine, since it is called from the interrupt handler.
 
+The RX STATUS instruction tells us which buffers are full and which
+filter accepted the message, so each message is classified before it is
+read:
+    RXB0 (filters 0 and 1)    Broadcast messages (PF = 240-255).  These
+                            are never network management messages, so
+                            they are read straight into the receive
+                            queue.
+    RXB1, filter 2            Messages sent to our address.  Only a
+                            request can need processing here.
+    RXB1, filters 3-5        Messages sent to the global address.  These
+                            go through the full network management check.
 
 NOTE: To save stack space, the function J1939_CommandedAddressHandling
 was brought inline.
@@ -786,72 +2403,118 @@ Return:        None
 void J1939_ReceiveMessages( void )
 {
     unsigned char    Status;
-    unsigned char    Mask = MCP_RX0IF;
+    #ifdef J1939_ACCEPT_CMDADD
     unsigned char    Loop;
+    #endif
 
     SELECT_MCP;
     #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-        WRITESPI( MCP_READ_STATUS );
+        WRITESPI( MCP_RX_STATUS );
         READSPI( Status );
     #else
-        WriteSPI( MCP_READ_STATUS );
+        WriteSPI( MCP_RX_STATUS );
         Status = ReadSPI();
     #endif
     UNSELECT_MCP;
 
-    Status &= (MCP_RX0IF | MCP_RX1IF);
-    while (Status != 0)
+    if (Status & MCP_RXSTAT_RXB0)
     {
-        if (Status & Mask)
+        STAT_COUNT( RXFrames );
+    #if defined(J1939_COMPACT_RX_QUEUE) || defined(J1939_MAILBOX_SIZE) || defined(J1939_SUBSCRIPTIONS)
+        // Broadcast handler.  A compact record's length isn't known until
+        // the DLC has been read, and neither is the PGN a mailbox or a
+        // subscription checks, so read the message into OneMessage first.
+        ReadReceiveBuffer( MCP_READ_RX0, (J1939_RX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+        #ifdef J1939_MAILBOX_SIZE
+        if (!MailboxStore())
+        #endif
+        #ifdef J1939_SUBSCRIPTIONS
+        if (Subscribed())
+        #endif
+        if (RXQueueAdd() != RC_SUCCESS)
+        {
+            J1939_Flags.Flags.ReceivedMessagesDropped = 1;
+            STAT_COUNT( RXDropped );
+        }
+    #else
+        // Broadcast handler.  Read the message directly into the next
+        // queue location, or the last one if we can overwrite it.
+        if (RXQueueCount < RX_QUEUE_LENGTH)
+        {
+        #ifdef J1939_LOCK_FREE_QUEUES
+            ReadReceiveBuffer( MCP_READ_RX0, RX_MSG(RX_SLOT(RXTail)) );
+            RXTail ++;
+        #else
+            RXTail ++;
+            if (RXTail >= RX_QUEUE_LENGTH)
+                RXTail = 0;
+            ReadReceiveBuffer( MCP_READ_RX0, RX_MSG(RXTail) );
+            RXQueueCount ++;
+        #endif
+            STAT_HIGH_WATER( RXHighWater, RXQueueCount );
+        }
+        else if (RX_CAN_OVERWRITE)
         {
-            // Read a message from the receive buffer
+            ReadReceiveBuffer( MCP_READ_RX0, RX_MSG(RXTail) );
+            STAT_COUNT( RXDropped );
+        }
+        else
+        {
+            // There's no room, so just release the buffer.  Its length
+            // isn't read, so it counts as a full message.
             SELECT_MCP;
             #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-                if (Mask == MCP_RX0IF)
-                    WRITESPI( MCP_READ_RX0 )
-                else
-                    WRITESPI( MCP_READ_RX1 )
-                for (Loop=0; Loop<J1939_MSG_LENGTH; Loop++)
-                    READSPI( OneMessage.Array[Loop] );
-                if (OneMessage.Msg.DataLength > 8)
-                    OneMessage.Msg.DataLength = 8;
-                for (Loop=0; Loop<OneMessage.Msg.DataLength; Loop++)
-                    READSPI( OneMessage.Msg.Data[Loop] );
+                WRITESPI( MCP_READ_RX0 );
             #else
-                if (Mask == MCP_RX0IF)
-                    WriteSPI( MCP_READ_RX0 );
-                else
-                    WriteSPI( MCP_READ_RX1 );
-                for (Loop=0; Loop<J1939_MSG_LENGTH; Loop++)
-                    OneMessage.Array[Loop] = ReadSPI();
-                if (OneMessage.Msg.DataLength > 8)
-                    OneMessage.Msg.DataLength = 8;
-                for (Loop=0; Loop<OneMessage.Msg.DataLength; Loop++)
-                    OneMessage.Msg.Data[Loop] = ReadSPI();
+                WriteSPI( MCP_READ_RX0 );
             #endif
             UNSELECT_MCP;
+            BUS_LOAD_COUNT( 8 );
+            J1939_Flags.Flags.ReceivedMessagesDropped = 1;
+            STAT_COUNT( RXDropped );
+        }
+    #endif
 
-            // Clear the receive flag, regardless of using polling or interrupts
+        // If RXB1 is full too, the filter bits belonged to RXB0.  Ask
+        // again now that RXB0 is empty.
+        if (Status & MCP_RXSTAT_RXB1)
+        {
             SELECT_MCP;
             #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-                WRITESPI( MCP_BITMOD );
-                WRITESPI( MCP_CANINTF );
-                WRITESPI( Mask );
-                WRITESPI( 0 );
+                WRITESPI( MCP_RX_STATUS );
+                READSPI( Status );
             #else
-                WriteSPI( MCP_BITMOD );
-                WriteSPI( MCP_CANINTF );
-                WriteSPI( Mask );
-                WriteSPI( 0 );
+                WriteSPI( MCP_RX_STATUS );
+                Status = ReadSPI();
             #endif
             UNSELECT_MCP;
+            Status |= MCP_RXSTAT_RXB1;
+        }
+    }
 
-            // Format the PDU Format portion so it's easier to work with.
-            Loop = (OneMessage.Msg.PDUFormat & 0xE0) >> 3;            // Get SID2-0 ready.
-            OneMessage.Msg.PDUFormat = (OneMessage.Msg.PDUFormat & 0x03) |
-                                        Loop |
-                                        ((OneMessage.Msg.PDUFormat_Top & 0x07) << 5);
-
+    if (Status & MCP_RXSTAT_RXB1)
+    {
+        STAT_COUNT( RXFrames );
+        ReadReceiveBuffer( MCP_READ_RX1, (J1939_RX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+
+        // If RXB0 filled up again, the filter bits belong to it, so we
+        // fall back to the global handler, which covers everything.  Also,
+        // filter 2 holds the global address until we have one of our own.
+        if (((Status & (MCP_RXSTAT_RXB0 | MCP_RXSTAT_FILHIT)) == MCP_RXSTAT_RXF2) &&
+            (OneMessage.Msg.DestinationAddress != J1939_GLOBAL_ADDRESS))
+        {
+            // Destination specific handler
+            if ((OneMessage.Msg.PDUFormat == J1939_PF_REQUEST) &&
+                (OneMessage.Msg.Data[0] == J1939_PGN0_REQ_ADDRESS_CLAIM) &&
+                (OneMessage.Msg.Data[1] == J1939_PGN1_REQ_ADDRESS_CLAIM) &&
+                (OneMessage.Msg.Data[2] == J1939_PGN2_REQ_ADDRESS_CLAIM))
+                J1939_RequestForAddressClaimHandling();
+            else
+                goto PutInReceiveQueue;
+        }
+        else
+        {
+            // Global handler
             switch( OneMessage.Msg.PDUFormat )
             {
 #ifdef J1939_ACCEPT_CMDADD
@@ -863,12 +2526,14 @@ void J1939_ReceiveMessages( void )
                     {
                         J1939_Flags.Flags.GettingCommandedAddress = 1;
                         CommandedAddressSource = OneMessage.Msg.SourceAddress;
+                        STAT_COUNT( NMFrames );
                     }
                     break;
                 case J1939_PF_DT:
                     if ((J1939_Flags.Flags.GettingCommandedAddress == 1) &&
                         (CommandedAddressSource == OneMessage.Msg.SourceAddress))
                     {    // Commanded Address Handling
+                        STAT_COUNT( NMFrames );
                         if ((!J1939_Flags.Flags.GotFirstDataPacket) &&
                             (OneMessage.Msg.Data[0] == 1))
                         {
@@ -907,27 +2572,42 @@ void J1939_ReceiveMessages( void )
                     break;
                 default:
 PutInReceiveQueue:
-                    if ((RXQueueCount < J1939_RX_QUEUE_SIZE) ||
-                        (J1939_OVERWRITE_RX_QUEUE == J1939_TRUE))
+                    #ifdef J1939_SUBSCRIPTIONS
+                    if (Subscribed())
+                    #endif
+                    if (RXQueueAdd() != RC_SUCCESS)
                     {
-                        if (RXQueueCount < J1939_RX_QUEUE_SIZE)
-                        {
-                            RXQueueCount ++;
-                            RXTail ++;
-                            if (RXTail >= J1939_RX_QUEUE_SIZE)
-                                RXTail = 0;
-                        }
-                        RXQueue[RXTail] = OneMessage;
-                    }
-                    else
                         J1939_Flags.Flags.ReceivedMessagesDropped = 1;
+                        STAT_COUNT( RXDropped );
+                    }
             }
         }
-        Status &= ~Mask;
-        Mask = MCP_RX1IF;
     }
 }
 
+/*********************************************************************
+J1939_ReleaseMessage
+
+This routine removes the message returned by J1939_PeekMessage from the
+receive queue.  The CA must not use the pointer after this.  If no
+message is being held, nothing happens.
+
+Parameters:    None
+Return:        None
+*********************************************************************/
+void J1939_ReleaseMessage( void )
+{
+    if (!J1939_Flags.Flags.ReceivedMessageHeld)
+        return;
+
+    LOCK_QUEUES;
+
+    RX_POP;
+    J1939_Flags.Flags.ReceivedMessageHeld = 0;
+
+    UNLOCK_QUEUES;
+}
+
 /*********************************************************************
 J1939_RequestForAddressClaimHandling
 
@@ -943,6 +2623,7 @@ NOTE:    J1939_PF_CANNOT_CLAIM_ADDRESS is the same value as
 *********************************************************************/
 void J1939_RequestForAddressClaimHandling( void )
 {
+    STAT_COUNT( NMFrames );
     if (J1939_Flags.Flags.CannotClaimAddress)
         OneMessage.Msg.SourceAddress = J1939_NULL_ADDRESS;    // Send Cannot Claim Address message
     else
@@ -953,17 +2634,161 @@ void J1939_RequestForAddressClaimHandling( void )
     OneMessage.Msg.DestinationAddress = J1939_GLOBAL_ADDRESS;
     OneMessage.Msg.DataLength = J1939_DATA_LENGTH;
     CopyName();
-    SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+    EncodeMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage );
+    SendNetworkMessage();
+}
+
+/*********************************************************************
+J1939_ReserveTxSlot
+
+This routine reserves the next transmit queue location so the CA can
+build a message directly in it, instead of building it in its own
+buffer and having J1939_EnqueueMessage copy it.  The CA fills in the
+message just as it would for J1939_EnqueueMessage, and then calls
+J1939_CommitTxSlot to queue it.  Until then, the message isn't visible
+to the transmit routines.  Unless the transmit queue is kept in priority
+bins, the location is the one after the tail, so J1939_EnqueueMessage
+will return RC_QUEUEFULL until then.  Calling this routine again before
+the commit returns the same location.
+
+NOTE: The pointer is to the transmit queue bank, not the CA's message
+bank.  A full queue is never overwritten to make room.
+
+Parameters:    None
+Return:        J1939_MESSAGE *        Pointer to the reserved location, or
+                                0 if the queue is full or the system
+                                cannot currently transmit messages
+*********************************************************************/
+J1939_TX_QUEUE_BANK J1939_MESSAGE *J1939_ReserveTxSlot( void )
+{
+    if (TXReserved == TX_NO_SLOT)
+    {
+        if (J1939_Flags.Flags.CannotClaimAddress)
+            return 0;
+
+    #ifdef J1939_TX_PRIORITY_BINS
+        // The transmit routines put locations back on the free list, so
+        // take one off with interrupts disabled.
+        #ifndef J1939_POLL_MCP
+            INTE = 0;
+        #endif
+        TXReserved = TXFree;
+        if (TXReserved != TX_NO_SLOT)
+            TXFree = TXNext[TXReserved];
+        #ifndef J1939_POLL_MCP
+            INTE = 1;
+        #endif
+        if (TXReserved == TX_NO_SLOT)
+            return 0;
+    #else
+        // The transmit routines only ever lower TXQueueCount, and they
+        // never touch the location after the tail.
+        if (TXQueueCount >= TX_QUEUE_LENGTH)
+            return 0;
+        #ifdef J1939_LOCK_FREE_QUEUES
+            TXReserved = TX_SLOT(TXTail);
+        #else
+            TXReserved = TXTail + 1;
+            if (TXReserved >= TX_QUEUE_LENGTH)
+                TXReserved = 0;
+        #endif
+    #endif
+    }
+    return TX_MSG(TXReserved);
+}
+
+/*********************************************************************
+J1939_SubscribePF
+
+This routine keeps every message received with a PDU Format.  For a
+broadcast PDU Format, that is every Group Extension, whether or not
+single PGNs have been subscribed to.  The interrupt routine only reads
+the table, and only one byte changes, so interrupts stay enabled.
+
+Parameters:    unsigned char        PDU Format
+Return:        None
+*********************************************************************/
+#ifdef J1939_SUBSCRIPTIONS
+void J1939_SubscribePF( unsigned char PDUFormat )
+{
+    SubscribedPF[PDUFormat >> 3] |= 1 << (PDUFormat & 0x07);
+}
+#endif
+
+/*********************************************************************
+J1939_SubscribePGN
+
+This routine keeps the messages received with one broadcast PGN.  The
+PGN is added to the sorted table, so if we're using interrupts, disable
+them while the table changes.
+
+Parameters:    unsigned char        PDU Format, which must be broadcast
+            unsigned char        Group Extension
+Return:        RC_SUCCESS            PGN subscribed successfully
+            RC_QUEUEFULL        The table is full
+            RC_PARAMERROR        The PDU Format is not broadcast
+*********************************************************************/
+#ifdef J1939_GE_SUBSCRIPTIONS
+unsigned char J1939_SubscribePGN( unsigned char PDUFormat, unsigned char GroupExtension )
+{
+    unsigned char    Loop;
+    unsigned char    rc = RC_SUCCESS;
+    unsigned char    Slot;
+
+    if (PDUFormat < J1939_PF_FIRST_BROADCAST)
+        return RC_PARAMERROR;
+
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+
+    Slot = FindSubscribedPGN( PDUFormat, GroupExtension );
+    if ((Slot < SubscribedPGNCount) &&
+        (SubscribedPGNPF[Slot] == PDUFormat) &&
+        (SubscribedPGNGE[Slot] == GroupExtension))
+        ;    // Already there
+    else if (SubscribedPGNCount >= J1939_GE_SUBSCRIPTIONS)
+        rc = RC_QUEUEFULL;
+    else
+    {
+        for (Loop = SubscribedPGNCount; Loop > Slot; Loop--)
+        {
+            SubscribedPGNPF[Loop] = SubscribedPGNPF[Loop-1];
+            SubscribedPGNGE[Loop] = SubscribedPGNGE[Loop-1];
+        }
+        SubscribedPGNPF[Slot] = PDUFormat;
+        SubscribedPGNGE[Slot] = GroupExtension;
+        SubscribedPGNCount ++;
+        SubscribedGE[(PDUFormat >> 3) & 0x01] |= 1 << (PDUFormat & 0x07);
+    }
+
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
+
+    return rc;
 }
+#endif
 
 /*********************************************************************
 J1939_TransmitMessages
 
 This routine transmits as many messages from the transmit queue as it
-can.  If the system cannot transmit messages, an error code is returned.
+can.  Every free transmit buffer is loaded, as long as the messages will
+still go out in order (see SendOneMessage), so the bus doesn't sit idle
+while we reload.  If the system cannot transmit messages, an error code
+is returned.
+
+With J1939_TX_PREEMPTION, if no more messages can be loaded and the next
+message has a higher J1939 priority than every message in the transmit
+buffers, it is sent ahead of them (see PreemptTransmitBuffer).
 Note that interrupts are disabled during this routine, since it is
 called from the interrupt handler.
 
+With a network management lane, a waiting network management message is
+loaded into TXB2 first.  These are sent even if we cannot claim an
+address, since one of them may be the Cannot Claim Address message.
+
 Parameters:    None
 Return:        RC_SUCCESS            Message was transmitted successfully
             RC_CANNOTTRANSMIT    System cannot transmit messages.
@@ -973,40 +2798,96 @@ Return:        RC_SUCCESS            Message was transmitted successfully
 *********************************************************************/
 unsigned char J1939_TransmitMessages( void )
 {
-    unsigned char Mask = 0x04;
-    unsigned char Status;
+    unsigned char rc = RC_CANNOTTRANSMIT;
+    #ifdef J1939_TX_PREEMPTION
+        unsigned char Mask;
+    #endif
+
+    #ifdef J1939_NM_TX_LANE
+        if (NMQueueCount != 0)
+        {
+            if (SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &(NMQueue[NMHead]),
+                                MCP_STAT_TX2REQ | TX_EXPRESS, 1 ) == RC_SUCCESS)
+            {
+                NMHead ++;
+                if (NMHead >= J1939_NM_QUEUE_SIZE)
+                    NMHead = 0;
+                NMQueueCount --;
+            }
+
+            #ifndef J1939_POLL_MCP
+                // Disable the TXB2 interrupt if the queue is empty
+                if (NMQueueCount == 0)
+                {
+                    SELECT_MCP;
+                    #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+                        WRITESPI( MCP_BITMOD );
+                        WRITESPI( MCP_CANINTE );
+                        WRITESPI( MCP_TX2_INT );
+                        WRITESPI( MCP_NO_INT );
+                    #else
+                        WriteSPI( MCP_BITMOD );
+                        WriteSPI( MCP_CANINTE );
+                        WriteSPI( MCP_TX2_INT );
+                        WriteSPI( MCP_NO_INT );
+                    #endif
+                    UNSELECT_MCP;
+                }
+            #endif
+        }
+    #endif
 
     if (TXQueueCount != 0)
     {
         if (J1939_Flags.Flags.CannotClaimAddress)
             return RC_CANNOTTRANSMIT;
 
-        SELECT_MCP;
-        #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
-            WRITESPI( MCP_READ_STATUS );
-            READSPI( Status );
-            Status &= MCP_TX01_MASK;                // Save only the transmit request flags.
-        #else
-            WriteSPI( MCP_READ_STATUS );
-            Status = ReadSPI() & MCP_TX01_MASK;        // Save only the transmit request flags.
+        #ifndef J1939_POLL_MCP
+            // Clear the transmit interrupt flags first.  A buffer that
+            // finishes after this will interrupt us again, so a free
+            // buffer that we can't load yet won't hold the interrupt line.
+            SELECT_MCP;
+            #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
+                WRITESPI( MCP_BITMOD );
+                WRITESPI( MCP_CANINTF );
+                WRITESPI( TX_INT_MASK );
+                WRITESPI( 0 );
+            #else
+                WriteSPI( MCP_BITMOD );
+                WriteSPI( MCP_CANINTF );
+                WriteSPI( TX_INT_MASK );
+                WriteSPI( 0 );
+            #endif
+            UNSELECT_MCP;
         #endif
-        UNSELECT_MCP;
 
-        if (Status == MCP_TX01_MASK)            // All transmit buffers are busy
-            return RC_CANNOTTRANSMIT;
-
-        while ((TXQueueCount > 0) && (Mask != 0))
+        // Keep loading buffers until the queue is empty or SendOneMessage
+        // can't find a buffer that keeps the messages in order.
+        while (TXQueueCount > 0)
         {
-            if ((Status & Mask) == 0)    // This buffer is free
+            TX_MSG(TX_HEAD)->Msg.SourceAddress = J1939_Address;
+            if (SendOneMessage( TX_MSG(TX_HEAD),
+                                APP_TX_MASK, 1 ) != RC_SUCCESS)
             {
-                TXQueue[TXHead].Msg.SourceAddress = J1939_Address;
-                SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &(TXQueue[TXHead]) );
-                TXHead ++;
-                if (TXHead >= J1939_TX_QUEUE_SIZE)
-                    TXHead = 0;
-                TXQueueCount --;
+                #ifdef J1939_TX_PREEMPTION
+                    // If the next message is more urgent than everything
+                    // in the transmit buffers, send it ahead of them.
+                    Mask = PreemptTransmitBuffer();
+                    if (Mask != 0)
+                    {
+                        SendOneMessage( (J1939_TX_QUEUE_BANK J1939_MESSAGE *) &OneMessage,
+                                        Mask | TX_EXPRESS, 0 );
+                        rc = RC_SUCCESS;
+                    }
+                #endif
+                break;
             }
-            Mask <<= 2;
+            #ifdef J1939_TX_PRIORITY_BINS
+                TXBinPop( 1 );
+            #else
+                TX_POP;
+            #endif
+            rc = RC_SUCCESS;
         }
 
         #ifndef J1939_POLL_MCP
@@ -1017,21 +2898,70 @@ unsigned char J1939_TransmitMessages( void )
                 #ifdef SPI_USE_ONLY_INLINE_DEFINITIONS
                     WRITESPI( MCP_BITMOD );
                     WRITESPI( MCP_CANINTE );
-                    WRITESPI( MCP_TX_INT );
+                    WRITESPI( TX_INT_MASK );
                     WRITESPI( MCP_NO_INT );
                 #else
                     WriteSPI( MCP_BITMOD );
                     WriteSPI( MCP_CANINTE );
-                    WriteSPI( MCP_TX_INT );
+                    WriteSPI( TX_INT_MASK );
                     WriteSPI( MCP_NO_INT );
                 #endif
                 UNSELECT_MCP;
+                J1939_Flags.Flags.TransmitInterruptsEnabled = 0;
             }
         #endif
 
-        return RC_SUCCESS;
+        return rc;
     }
     return RC_QUEUEEMPTY;
 }
 
+/*********************************************************************
+J1939_Unsubscribe
+
+This routine stops keeping the messages received with a PDU Format,
+including any single PGNs subscribed to with it.  If we're using
+interrupts, disable them while the tables change.
+
+Parameters:    unsigned char        PDU Format
+Return:        None
+*********************************************************************/
+#ifdef J1939_SUBSCRIPTIONS
+void J1939_Unsubscribe( unsigned char PDUFormat )
+{
+    #ifdef J1939_GE_SUBSCRIPTIONS
+    unsigned char    Loop;
+    unsigned char    Slot;
+    #endif
+
+    #ifndef J1939_POLL_MCP
+        INTE = 0;
+    #endif
+
+    SubscribedPF[PDUFormat >> 3] &= ~(1 << (PDUFormat & 0x07));
+
+    #ifdef J1939_GE_SUBSCRIPTIONS
+    if (PDUFormat >= J1939_PF_FIRST_BROADCAST)
+    {
+        SubscribedGE[(PDUFormat >> 3) & 0x01] &= ~(1 << (PDUFormat & 0x07));
+        Slot = 0;
+        for (Loop = 0; Loop < SubscribedPGNCount; Loop++)
+        {
+            if (SubscribedPGNPF[Loop] != PDUFormat)
+            {
+                SubscribedPGNPF[Slot] = SubscribedPGNPF[Loop];
+                SubscribedPGNGE[Slot] = SubscribedPGNGE[Loop];
+                Slot ++;
+            }
+        }
+        SubscribedPGNCount = Slot;
+    }
+    #endif
+
+    #ifndef J1939_POLL_MCP
+        INTE = 1;
+    #endif
+}
+#endif
+
 
@@ -68,12 +68,27 @@ Copyright 2003 Kimberly Otten Software Consulting
 
 #define MCP_TX_INT        0x1C        // Enable all transmit interrupts
 #define MCP_TX01_INT    0x0C        // Enable TXB0 and TXB1 interrupts
+#define MCP_TX2_INT        0x10        // Enable TXB2 interrupt
 #define MCP_RX_INT        0x03        // Enable receive interrupts
 #define MCP_NO_INT        0x00        // Disable all interrupts
 
 #define MCP_TX01_MASK    0x14
 #define MCP_TX_MASK        0x54
 
+#define MCP_STAT_TX0REQ    0x04        // READ STATUS: TXB0 transmit request
+#define MCP_STAT_TX1REQ    0x10        // READ STATUS: TXB1 transmit request
+#define MCP_STAT_TX2REQ    0x40        // READ STATUS: TXB2 transmit request
+
+#define MCP_RXSTAT_RXB0    0x40        // RX STATUS: message in RXB0
+#define MCP_RXSTAT_RXB1    0x80        // RX STATUS: message in RXB1
+#define MCP_RXSTAT_FILHIT  0x07        // RX STATUS: filter match bits
+#define MCP_RXSTAT_RXF0    0x00
+#define MCP_RXSTAT_RXF1    0x01
+#define MCP_RXSTAT_RXF2    0x02
+#define MCP_RXSTAT_RXF3    0x03
+#define MCP_RXSTAT_RXF4    0x04
+#define MCP_RXSTAT_RXF5    0x05
+
 // Define SPI Instruction Set
 
 #define MCP_WRITE        0x02
@@ -120,6 +135,18 @@ Copyright 2003 Kimberly Otten Software Consulting
 #define CLKOUT_PS8        0x03
 
 
+// TXBnCTRL Register Values
+
+#define MCP_TXB_ABTF    0x40        // Message was aborted
+#define MCP_TXB_MLOA    0x20        // Message lost arbitration
+#define MCP_TXB_TXERR    0x10        // Transmission error detected
+#define MCP_TXB_TXREQ    0x08        // Message transmit request
+#define TXP_HIGHEST        0x03
+#define TXP_HIGH        0x02
+#define TXP_LOW            0x01
+#define TXP_LOWEST        0x00
+
+
 // CNF1 Register Values
 
 #define SJW1            0x00
@@ -26,22 +26,55 @@ Copyright 2003 Kimberly Otten Software Consulting
 // Give visibility to the global variables.
 
 extern J1939_FLAG                            J1939_Flags;
+#ifdef J1939_LOCK_FREE_QUEUES
+extern J1939_RX_QUEUE_BANK volatile unsigned char    RXHead;
+extern J1939_RX_QUEUE_BANK volatile unsigned char    RXTail;
+#define RXQueueCount    ((unsigned char)(RXTail - RXHead))
+#else
 extern J1939_RX_QUEUE_BANK unsigned char    RXQueueCount;
+#endif
 
 
 // Library function prototypes
 
 void             J1939_AddressClaimHandling( unsigned char Mode );
+unsigned char    J1939_CommitTxSlot( void );
 #ifdef J1939_ACCEPT_CMDADD
 void            J1939_CommandedAddressHandling( void );
 #endif
 unsigned char    J1939_DequeueMessage( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr );
+unsigned char    J1939_DequeueMessages( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr, unsigned char Count );
 unsigned char      J1939_EnqueueMessage( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr );
+unsigned char      J1939_EnqueueMessages( J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr, unsigned char Count );
 void             J1939_Initialization( void );
 void            J1939_ISR( void );
+#ifdef J1939_MAILBOX_SIZE
+unsigned char    J1939_OpenMailbox( unsigned char Box, J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr );
+#endif
+J1939_RX_QUEUE_BANK J1939_MESSAGE *J1939_PeekMessage( void );
 void             J1939_Poll( unsigned char ElapsedTime );
+#ifdef J1939_MEASURE_BUS_LOAD
+void            J1939_ReadBusLoad( J1939_USER_MSG_BANK J1939_BUS_LOAD *LoadPtr, unsigned char Reset );
+#endif
+#ifdef J1939_MAILBOX_SIZE
+unsigned char    J1939_ReadMailbox( unsigned char Box, J1939_USER_MSG_BANK J1939_MESSAGE *MsgPtr );
+#endif
+#ifdef J1939_COLLECT_STATISTICS
+void            J1939_ReadStatistics( J1939_USER_MSG_BANK J1939_STATISTICS *StatPtr, unsigned char Reset );
+#endif
 void             J1939_ReceiveMessages( void );
+void            J1939_ReleaseMessage( void );
 void             J1939_RequestForAddressClaimHandling( void );
+J1939_TX_QUEUE_BANK J1939_MESSAGE *J1939_ReserveTxSlot( void );
+#ifdef J1939_SUBSCRIPTIONS
+void            J1939_SubscribePF( unsigned char PDUFormat );
+#endif
+#ifdef J1939_GE_SUBSCRIPTIONS
+unsigned char    J1939_SubscribePGN( unsigned char PDUFormat, unsigned char GroupExtension );
+#endif
 unsigned char     J1939_TransmitMessages( void );
+#ifdef J1939_SUBSCRIPTIONS
+void            J1939_Unsubscribe( unsigned char PDUFormat );
+#endif
 
 #endif
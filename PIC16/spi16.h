@@ -93,6 +93,34 @@ void             putsSPI( unsigned char *wrptr );
                             while( !STAT_BF );    \
                     }
 
+// Burst write alternates.  These are used to stream a block of bytes in a
+// single chip select without a function call per byte.  The next byte is
+// fetched while the SSP is still shifting out the current one, and it is
+// written as soon as BF shows that the previous transfer has finished.
+// SSPBUF is read after each transfer to clear BF, so a write collision
+// cannot occur.  A burst must start with BURSTSPI_FIRST and end with
+// BURSTSPI_LAST.
+
+#define BURSTSPI_FIRST( Val, Dummy )            \
+                    {                           \
+                        Dummy = SSPBUF;         \
+                        SSPBUF = Val;           \
+                    }
+
+#define BURSTSPI_NEXT( Val, Next, Dummy )       \
+                    {                           \
+                        Next = Val;             \
+                        while ( !STAT_BF );     \
+                        Dummy = SSPBUF;         \
+                        SSPBUF = Next;          \
+                    }
+
+#define BURSTSPI_LAST( Dummy )                  \
+                    {                           \
+                        while ( !STAT_BF );     \
+                        Dummy = SSPBUF;         \
+                    }
+
 
 #endif  /* __SPI16_H */
 
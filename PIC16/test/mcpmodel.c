@@ -0,0 +1,243 @@
+/*
+mcpmodel.c
+
+Host model of the MCP2515, for the simulations in this directory.  A
+simulation includes it after J1939_16.c and spi16.c.  The model answers
+the SPI instructions the library uses (RESET, READ, WRITE, BIT MODIFY,
+LOAD TX BUFFER, RTS, READ STATUS, RX STATUS, and READ RX BUFFER), one
+byte each time pic.h's STAT_BF is read, and it counts the transactions
+and bytes.
+
+The bus is driven by the simulation.  McpBusStart picks the buffer the
+MCP2515 would send next and McpBusEnd finishes it, which sets its
+transmit interrupt flag.  While a buffer is on the bus, clearing its
+TXREQ doesn't abort it, just as on the chip.  McpReceive puts a message
+in a receive buffer as if one of the filters had accepted it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+unsigned char   McpReg[128];
+unsigned char   McpPin = 1;             // Chip select pin
+unsigned long   McpSelects;             // Transactions
+unsigned long   McpBytes;               // Bytes shifted in those transactions
+signed char     McpOnBus = -1;          // Buffer being sent, or -1
+unsigned long   McpLoaded[3];           // McpBytes at each buffer's last RTS
+
+static unsigned char    McpCommand;
+static unsigned char    McpAddress;
+static unsigned char    McpCount;
+static unsigned char    McpMask;
+
+// TXBnCTRL bits, named here because older versions of mcp2515.h don't.
+
+#define McpTXREQ        0x08
+#define McpABTF         0x40
+
+#define McpTXB(Buffer)  (&McpReg[MCP_TXB0CTRL + 1 + ((Buffer) << 4)])
+#define McpRXB(Buffer)  (&McpReg[MCP_RXB0SIDH + ((Buffer) << 4)])
+#define McpInt()        ((McpReg[MCP_CANINTF] & McpReg[MCP_CANINTE]) != 0)
+
+// J1939 fields of a register image (SIDH through the data bytes).
+
+#define McpPriority(Image)  ((Image)[0] >> 5)
+#define McpPF(Image)        ((((Image)[0] & 0x07) << 5) | (((Image)[1] >> 3) & 0x1C) | ((Image)[1] & 0x03))
+#define McpPS(Image)        ((Image)[2])
+#define McpSA(Image)        ((Image)[3])
+#define McpDLC(Image)       ((Image)[4] & 0x0F)
+#define McpData(Image)      (&(Image)[5])
+
+static void McpWrite( unsigned char Address, unsigned char Data )
+{
+    unsigned char Flags;
+
+    Address &= 0x7F;
+    if ((Address & 0x0F) == 0 && Address >= MCP_TXB0CTRL && Address <= MCP_TXB2CTRL)
+    {
+        // Only TXREQ and TXP can be written.  Setting TXREQ clears ABTF,
+        // MLOA and TXERR, and clearing it aborts the message, unless it
+        // is already on the bus.
+        Flags = McpReg[Address] & 0x70;
+        if (Data & McpTXREQ)
+            Flags = 0;
+        else if (McpReg[Address] & McpTXREQ)
+        {
+            if (McpOnBus == ((Address - MCP_TXB0CTRL) >> 4))
+                Data |= McpTXREQ;
+            else
+                Flags |= McpABTF;
+        }
+        McpReg[Address] = Flags | (Data & 0x0B);
+    }
+    else
+    {
+        McpReg[Address] = Data;
+        if (Address == MCP_CANCTRL)
+            McpReg[MCP_CANSTAT] = Data & MODE_MASK;
+    }
+}
+
+// READ STATUS: RX0IF and RX1IF, then TXREQ and TXnIF for each transmit
+// buffer.
+
+static unsigned char McpStatus( void )
+{
+    unsigned char Status = McpReg[MCP_CANINTF] & 0x03;
+
+    if (McpReg[MCP_CANINTF] & 0x04)             Status |= 0x08;
+    if (McpReg[MCP_CANINTF] & 0x08)             Status |= 0x20;
+    if (McpReg[MCP_CANINTF] & 0x10)             Status |= 0x80;
+    if (McpReg[MCP_TXB0CTRL] & McpTXREQ)        Status |= 0x04;
+    if (McpReg[MCP_TXB1CTRL] & McpTXREQ)        Status |= 0x10;
+    if (McpReg[MCP_TXB2CTRL] & McpTXREQ)        Status |= 0x40;
+    return Status;
+}
+
+static unsigned char McpRXStatus( void )
+{
+    unsigned char Status = 0;
+
+    // Bits 7 and 6 show which buffers are full, bits 4 and 3 that the
+    // message is an extended data frame, and bits 2 to 0 the filter that
+    // accepted it (RXB0's if both are full).
+    if (McpReg[MCP_CANINTF] & MCP_RX0IF)
+        Status |= 0x40 | 0x10 | (McpReg[MCP_RXB0CTRL] & 0x01);
+    if (McpReg[MCP_CANINTF] & MCP_RX1IF)
+    {
+        Status |= 0x80 | 0x10;
+        if (!(Status & 0x40))
+            Status |= McpReg[MCP_RXB1CTRL] & 0x07;
+    }
+    return Status;
+}
+
+unsigned char * McpChipSelect( void )
+{
+    if (McpPin == 0)
+    {
+        // The pin is going high, so the instruction ends.
+        if (McpCount != 0)
+            McpSelects ++;
+        if (McpCount != 0 && (McpCommand & 0xF9) == MCP_READ_RX0)
+            McpReg[MCP_CANINTF] &= (McpCommand & 0x04) ? ~MCP_RX1IF : ~MCP_RX0IF;
+    }
+    McpCount = 0;
+    return &McpPin;
+}
+
+unsigned char McpShift( void )
+{
+    unsigned char In = SSPBUF;
+    unsigned char Out = 0xFF;
+    unsigned char Buffer;
+
+    if (McpPin != 0)
+    {
+        printf( "SPI byte 0x%02X sent without chip select\n", In );
+        exit( 2 );
+    }
+    McpBytes ++;
+    McpCount ++;
+
+    if (McpCount == 1)
+    {
+        McpCommand = In;
+        if (In == MCP_RESET)
+        {
+            for (Buffer = 0; Buffer < 128; Buffer++)
+                McpReg[Buffer] = 0;
+            McpReg[MCP_CANCTRL] = 0x87;
+            McpReg[MCP_CANSTAT] = MODE_CONFIG;
+            McpOnBus = -1;
+        }
+        else if ((In & 0xF9) == MCP_READ_RX0)
+            McpAddress = MCP_RXB0SIDH + ((In & 0x04) << 2) + ((In & 0x02) ? 4 : 0);
+        else if ((In & 0xF8) == MCP_LOAD_TX0)
+            McpAddress = MCP_TXB0CTRL + 1 + ((In & 0x06) << 3) + ((In & 0x01) ? 5 : 0);
+        else if ((In & 0xF8) == 0x80)
+        {
+            for (Buffer = 0; Buffer < 3; Buffer++)
+                if (In & (1 << Buffer))
+                {
+                    McpReg[MCP_TXB0CTRL + (Buffer << 4)] =
+                        (McpReg[MCP_TXB0CTRL + (Buffer << 4)] & 0x03) | McpTXREQ;
+                    McpLoaded[Buffer] = McpBytes;
+                }
+        }
+    }
+    else if (McpCommand == MCP_READ_STATUS)
+        Out = McpStatus();
+    else if (McpCommand == MCP_RX_STATUS)
+        Out = McpRXStatus();
+    else if ((McpCommand & 0xF9) == MCP_READ_RX0)
+        Out = McpReg[McpAddress++ & 0x7F];
+    else if ((McpCommand & 0xF8) == MCP_LOAD_TX0)
+        McpWrite( McpAddress++, In );
+    else if (McpCount == 2)
+        McpAddress = In;
+    else if (McpCommand == MCP_READ)
+        Out = McpReg[McpAddress++ & 0x7F];
+    else if (McpCommand == MCP_WRITE)
+        McpWrite( McpAddress++, In );
+    else if (McpCommand == MCP_BITMOD && McpCount == 3)
+        McpMask = In;
+    else if (McpCommand == MCP_BITMOD && McpCount == 4)
+        McpWrite( McpAddress, (McpReg[McpAddress & 0x7F] & ~McpMask) | (In & McpMask) );
+
+    SSPBUF = Out;
+    return 1;
+}
+
+// The buffer the MCP2515 sends next out of the ones in Allowed (READ
+// STATUS transmit request bits): the highest TXP, and the highest buffer
+// number within a TXP.  It stays on the bus until McpBusEnd.
+
+signed char McpBusStart( unsigned char Allowed )
+{
+    signed char Buffer;
+    signed char Best = -1;
+    unsigned char Ctrl;
+
+    for (Buffer = 0; Buffer < 3; Buffer++)
+    {
+        Ctrl = McpReg[MCP_TXB0CTRL + (Buffer << 4)];
+        if ((Ctrl & McpTXREQ) && (Allowed & (0x04 << (Buffer << 1))) &&
+            ((Best < 0) || ((Ctrl & 0x03) >= (McpReg[MCP_TXB0CTRL + (Best << 4)] & 0x03))))
+            Best = Buffer;
+    }
+    McpOnBus = Best;
+    return Best;
+}
+
+void McpBusEnd( void )
+{
+    if (McpOnBus < 0)
+        return;
+    McpReg[MCP_TXB0CTRL + (McpOnBus << 4)] &= ~McpTXREQ;
+    McpReg[MCP_CANINTF] |= 0x04 << McpOnBus;
+    McpOnBus = -1;
+}
+
+// Puts a message in a receive buffer as if filter Filter had accepted
+// it.  Returns 0 if the buffer is still full.
+
+unsigned char McpReceive( unsigned char Buffer, unsigned char Filter, unsigned char Priority,
+                          unsigned char PF, unsigned char PS, unsigned char SA,
+                          unsigned char Length, unsigned char *Data )
+{
+    unsigned char *Image = McpRXB( Buffer );
+    unsigned char Loop;
+
+    if (McpReg[MCP_CANINTF] & (Buffer ? MCP_RX1IF : MCP_RX0IF))
+        return 0;
+    Image[0] = (Priority << 5) | (PF >> 5);
+    Image[1] = ((PF & 0x1C) << 3) | 0x08 | (PF & 0x03);
+    Image[2] = PS;
+    Image[3] = SA;
+    Image[4] = Length;
+    for (Loop = 0; Loop < 8; Loop++)
+        Image[5 + Loop] = (Loop < Length) ? Data[Loop] : 0;
+    McpReg[MCP_RXB0CTRL + (Buffer << 4)] = Filter;
+    McpReg[MCP_CANINTF] |= Buffer ? MCP_RX1IF : MCP_RX0IF;
+    return 1;
+}
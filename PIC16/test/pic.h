@@ -0,0 +1,29 @@
+/*
+pic.h
+
+Host model of the HI-TECH pic.h, so the simulations in this directory
+can include J1939_16.c and spi16.c and run them with gcc.  The bank
+qualifiers are dropped and the registers the library uses are plain
+variables, except for the two that talk to the MCP2515.  Reading STAT_BF
+shifts the byte in SSPBUF out to the MCP2515 model in mcpmodel.c and
+puts its answer in SSPBUF.  RC0, the chip select pin, tells the model
+that a transaction starts or ends each time it is written.
+*/
+#ifndef __pic_h
+#define __pic_h
+
+#define bank0
+#define bank1
+#define bank2
+#define bank3
+
+unsigned char   McpShift( void );
+unsigned char * McpChipSelect( void );
+
+unsigned char SSPBUF, SSPSTAT, SSPCON, STAT_SMP, STAT_CKE, CKP, SSPEN, WCOL;
+unsigned char TRISC0, TRISC3, TRISC4, TRISC5, TRISA5, TRISB0, INTEDG, INTE, INTF, GIE;
+
+#define STAT_BF     McpShift()
+#define RC0         (*McpChipSelect())
+
+#endif
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Host simulations of the PIC16 J1939 library.  Each simulation includes
+# J1939_16.c and SPI16.C with the pic.h and MCP2515 model in this
+# directory and the settings in J1939Cfg.h, changed as listed below, and
+# exits with a nonzero status if a check fails.  The headers are copied
+# under the lowercase names the library includes them by.
+#
+# With REV set to a git revision, the library is taken from that
+# revision instead, so a change can be measured before and after, as in
+# REV=HEAD~1 sh run.sh rx_spi.
+#
+# A number at the end of a simulation's name picks its settings, so
+# tx_pipeline2 runs tx_pipeline.c with only two transmit buffers.
+#
+# Usage:  sh run.sh [simulation ...]       (default: all of them)
+
+TEST=`cd \`dirname $0\` && pwd`
+LIB=`dirname $TEST`
+WORK=`mktemp -d`
+trap 'rm -rf $WORK' 0
+
+fetch()
+{
+	if [ -n "$REV" ]; then
+		git -C $LIB show $REV:PIC16/$1
+	else
+		cat $LIB/$1
+	fi
+}
+
+for FILE in J1939_16.c SPI16.C J1939_16.H MCP2515.h j1939pro.h spi16.h; do
+	fetch $FILE | tr -d '\r' > $WORK/`echo $FILE | tr A-Z a-z` || exit 1
+done
+
+options()
+{
+	case $1 in
+	tx_pipeline2)	echo "-DJ1939_NM_TX_LANE" ;;
+	tx_bins1)		echo "-DJ1939_TX_PRIORITY_BINS" ;;
+	esac
+}
+
+# Changes to J1939Cfg.h, as a sed script.
+
+settings()
+{
+	case $1 in
+	rx_spi)		echo "s/J1939_RX_QUEUE_SIZE .*/J1939_RX_QUEUE_SIZE 4/" ;;
+	tx_pipeline*)	echo "s/J1939_TX_QUEUE_SIZE .*/J1939_TX_QUEUE_SIZE 8/" ;;
+	tx_bins*)		echo "s/J1939_TX_QUEUE_SIZE .*/J1939_TX_QUEUE_SIZE 16/" ;;
+	esac
+}
+
+SIMS=${*:-"rx_spi tx_pipeline3 tx_pipeline2 tx_bins0 tx_bins1"}
+STATUS=0
+for SIM in $SIMS; do
+	echo "== $SIM"
+	mkdir $WORK/$SIM
+	fetch J1939Cfg.h | tr -d '\r' | sed "`settings $SIM`" > $WORK/$SIM/j1939cfg.h
+	gcc -std=gnu99 -Wall -Wno-unknown-pragmas -Wno-unused -Wno-missing-braces \
+		-Wno-dangling-else -Wno-misleading-indentation -I$WORK/$SIM -I$WORK -I$TEST \
+		`options $SIM` $TEST/`echo $SIM | sed 's/[0-9]*$//'`.c -o $WORK/$SIM/sim &&
+		$WORK/$SIM/sim || STATUS=1
+done
+exit $STATUS
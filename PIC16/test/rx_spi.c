@@ -0,0 +1,84 @@
+/*
+SPI traffic on the receive path: the chip selects and bytes that
+J1939_ReceiveMessages takes per received message, for a broadcast
+message in RXB0, a destination specific and a global message in RXB1,
+both buffers full at once, and a broadcast message that finds the
+receive queue full.  Each message must reach the receive queue, except
+the last one, and both receive flags must be clear afterwards.
+
+Run it with REV set to compare revisions of the library.
+*/
+#include "j1939_16.c"
+#include "spi16.c"
+#include "mcpmodel.c"
+
+#define CHECK(c) do { if (!(c)) { printf( "FAIL line %d\n", __LINE__ ); return 1; } } while (0)
+
+static unsigned char Data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+static void Report( const char *Case, unsigned char Messages )
+{
+    printf( "%-28s %2lu selects %3lu bytes   %4.1f selects %5.1f bytes per message\n",
+            Case, McpSelects, McpBytes,
+            (double) McpSelects / Messages, (double) McpBytes / Messages );
+    McpSelects = 0;
+    McpBytes = 0;
+}
+
+static int Queued( unsigned char PDUFormat, unsigned char PDUSpecific )
+{
+    J1939_MESSAGE Msg;
+
+    return (J1939_DequeueMessage( &Msg ) == RC_SUCCESS) &&
+           (Msg.Msg.PDUFormat == PDUFormat) && (Msg.Msg.PDUSpecific == PDUSpecific) &&
+           (Msg.Msg.DataLength == 8) && (Msg.Msg.Data[7] == 8);
+}
+
+int main( void )
+{
+    unsigned char Loop;
+
+    J1939_Initialization();
+    J1939_Flags.FlagVal = 0;
+    McpReg[MCP_CANINTF] = 0;
+    McpSelects = 0;
+    McpBytes = 0;
+
+    McpReceive( 0, 0, 6, 0xFE, 0xF1, 0x20, 8, Data );
+    J1939_ReceiveMessages();
+    Report( "broadcast, RXB0", 1 );
+    CHECK( Queued( 0xFE, 0xF1 ) );
+
+    McpReceive( 1, 2, 6, 0xEF, J1939_Address, 0x20, 8, Data );
+    J1939_ReceiveMessages();
+    Report( "destination specific, RXB1", 1 );
+    CHECK( Queued( 0xEF, J1939_Address ) );
+
+    McpReceive( 1, 3, 6, 0xEF, J1939_GLOBAL_ADDRESS, 0x20, 8, Data );
+    J1939_ReceiveMessages();
+    Report( "global, RXB1", 1 );
+    CHECK( Queued( 0xEF, J1939_GLOBAL_ADDRESS ) );
+
+    McpReceive( 0, 1, 6, 0xFE, 0xF2, 0x20, 8, Data );
+    McpReceive( 1, 2, 6, 0xEF, J1939_Address, 0x21, 8, Data );
+    J1939_ReceiveMessages();
+    Report( "both buffers", 2 );
+    CHECK( Queued( 0xFE, 0xF2 ) );
+    CHECK( Queued( 0xEF, J1939_Address ) );
+
+    for (Loop = 0; Loop < J1939_RX_QUEUE_SIZE; Loop++)
+    {
+        McpReceive( 0, 0, 6, 0xFE, 0xF1, 0x20, 8, Data );
+        J1939_ReceiveMessages();
+    }
+    McpSelects = 0;
+    McpBytes = 0;
+    McpReceive( 0, 0, 6, 0xFE, 0xF3, 0x20, 8, Data );
+    J1939_ReceiveMessages();
+    Report( "broadcast, queue full", 1 );
+    CHECK( J1939_Flags.Flags.ReceivedMessagesDropped );
+
+    CHECK( (McpReg[MCP_CANINTF] & (MCP_RX0IF | MCP_RX1IF)) == 0 );
+    puts( "rx_spi ok" );
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+Waiting time in the transmit queue, by J1939 priority, at 250 kbit/s.
+For 10 s the CA queues a priority 3 message every 10 ms, two priority 6
+messages every 50 ms, a block of 12 priority 6 messages every 100 ms, and
+a priority 7 message every 20 ms.  Once per 8 byte frame time (568 us)
+the frame on the bus ends, J1939_TransmitMessages refills the transmit
+buffers, and the MCP2515 starts the next frame.  The worst wait of each
+priority, from J1939_EnqueueMessage to the start of its frame, is
+printed.
+
+Run as tx_bins0 the queue is one FIFO, so the priority 3 message can
+wait behind the block.  Run as tx_bins1 (J1939_TX_PRIORITY_BINS) it only
+waits for the messages already in the transmit buffers, so never longer
+than four frame times.  Either way the messages of each priority must go
+out in order.
+*/
+#include "j1939_16.c"
+#include "spi16.c"
+#include "mcpmodel.c"
+
+#define CHECK(c) do { if (!(c)) { printf( "FAIL line %d\n", __LINE__ ); return 1; } } while (0)
+
+#define FRAME_US    568ul
+#define RUN_US      10000000ul
+
+struct TRAFFIC {
+    unsigned char   Priority;
+    unsigned char   Count;
+    unsigned long   Period;
+    unsigned long   Phase;
+};
+
+static const struct TRAFFIC Traffic[] = {
+    { 3, 1,  10000,  100 },
+    { 6, 2,  50000, 2000 },
+    { 6, 12, 100000,   0 },
+    { 7, 1,  20000, 5000 },
+};
+
+#define STREAMS     (sizeof(Traffic) / sizeof(Traffic[0]))
+
+static unsigned long    Due[STREAMS];
+static unsigned long    WorstWait[8];
+static unsigned long    Sent[8];
+static unsigned long    Rejected[8];
+static unsigned int     Queued[8];
+static unsigned int     Expected[8];
+
+static void Enqueue( unsigned char Priority, unsigned long Stamp )
+{
+    J1939_MESSAGE Msg;
+
+    Msg.Msg.Priority = Priority;
+    Msg.Msg.DataPage = 0;
+    Msg.Msg.PDUFormat = 0xFF;
+    Msg.Msg.PDUSpecific = Priority;
+    Msg.Msg.DataLength = 8;
+    Msg.Msg.Data[0] = Stamp >> 24;
+    Msg.Msg.Data[1] = Stamp >> 16;
+    Msg.Msg.Data[2] = Stamp >> 8;
+    Msg.Msg.Data[3] = Stamp;
+    Msg.Msg.Data[4] = Queued[Priority] >> 8;
+    Msg.Msg.Data[5] = Queued[Priority];
+    if (J1939_EnqueueMessage( &Msg ) == RC_SUCCESS)
+        Queued[Priority] ++;
+    else
+        Rejected[Priority] ++;
+}
+
+// Starts the next frame, if there is one, and returns 0 if the messages
+// of its priority are out of order.
+
+static int StartFrame( unsigned long Now )
+{
+    unsigned char *Image;
+    unsigned char Priority;
+    unsigned long Stamp;
+    unsigned int Number;
+
+    if (McpBusStart( 0x54 ) < 0)
+        return 1;
+    Image = McpTXB( McpOnBus );
+    Priority = McpPriority( Image );
+    Stamp = ((unsigned long) McpData( Image )[0] << 24) | ((unsigned long) McpData( Image )[1] << 16) |
+            ((unsigned long) McpData( Image )[2] << 8) | McpData( Image )[3];
+    Number = (McpData( Image )[4] << 8) | McpData( Image )[5];
+
+    if (Now - Stamp > WorstWait[Priority])
+        WorstWait[Priority] = Now - Stamp;
+    Sent[Priority] ++;
+    if (Number != Expected[Priority])
+        return 0;
+    Expected[Priority] ++;
+    return 1;
+}
+
+int main( void )
+{
+    unsigned long Now;
+    unsigned char Stream;
+    unsigned char Loop;
+    unsigned char Priority;
+
+    // Start with the address claim sent and all transmit buffers free.
+    J1939_Initialization();
+    J1939_Flags.Flags.CannotClaimAddress = 0;
+    J1939_Flags.Flags.WaitingForAddressClaimContention = 0;
+    for (Loop = 0; Loop < 3; Loop++)
+        McpReg[MCP_TXB0CTRL + (Loop << 4)] = 0;
+    #ifdef J1939_TX_PRIORITY_BINS
+        puts( "with priority bins" );
+    #else
+        puts( "without priority bins" );
+    #endif
+
+    for (Stream = 0; Stream < STREAMS; Stream++)
+        Due[Stream] = Traffic[Stream].Phase;
+
+    // Each pass is one frame time.  The messages that came in during the
+    // last frame are queued, the frame ends, the buffers are refilled,
+    // and the next frame starts.
+    for (Now = 0; Now < RUN_US; Now += FRAME_US)
+    {
+        for (Stream = 0; Stream < STREAMS; Stream++)
+        {
+            while (Due[Stream] <= Now)
+            {
+                for (Loop = 0; Loop < Traffic[Stream].Count; Loop++)
+                    Enqueue( Traffic[Stream].Priority, Due[Stream] );
+                Due[Stream] += Traffic[Stream].Period;
+            }
+        }
+        McpBusEnd();
+        J1939_TransmitMessages();
+        CHECK( StartFrame( Now ) );
+    }
+
+    for (Priority = 0; Priority < 8; Priority++)
+    {
+        if (Sent[Priority] + Rejected[Priority] != 0)
+            printf( "priority %u: %5lu sent, %3lu rejected, worst wait %5.1f ms\n",
+                    Priority, Sent[Priority], Rejected[Priority], WorstWait[Priority] / 1000.0 );
+    }
+
+    #ifdef J1939_TX_PRIORITY_BINS
+        CHECK( WorstWait[3] < 4 * FRAME_US );
+    #endif
+    puts( "tx_bins ok" );
+    return 0;
+}
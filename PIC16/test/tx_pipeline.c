@@ -0,0 +1,225 @@
+/*
+Back-to-back transmit queue drains.  The CA keeps the transmit queue
+topped up with 500 messages numbered in order, and J1939_ISR runs on
+each falling edge of the MCP2515's INT line, after an interrupt latency,
+to refill the transmit buffers.  Each SPI byte takes 3 us of the ISR, and
+a buffer can win the bus once its RTS has gone out.  An 8 byte frame is
+142 bits long.  With other traffic, each time the bus goes idle there is
+that chance that another node's frame wins it, so the CA's messages pile
+up in the transmit buffers.
+
+For each bit rate, latency, and share of other traffic the simulation
+prints the frames/s the CA reached and how busy the bus was, and it
+counts the messages that went out of order.  Run as tx_pipeline3 it uses
+all three transmit buffers, and as tx_pipeline2 (J1939_NM_TX_LANE) only
+TXB0 and TXB1.  Any message out of order fails it.
+*/
+#include "j1939_16.c"
+#include "spi16.c"
+#include "mcpmodel.c"
+
+#define MESSAGES        500
+#define FRAME_BITS      142
+#define SPI_BYTE_US     3
+#define NEVER           0xFFFFFFFFul
+
+static unsigned long    Now;
+static unsigned long    IntAt;              // When the INT line fell, or NEVER
+static unsigned long    CpuFree;            // When the last ISR finished
+static unsigned long    ReadyAt[3];         // When each buffer's RTS went out
+static unsigned long    BusEnd;             // When the frame on the bus ends, or NEVER
+static unsigned char    IntLine;
+static unsigned int     Queued;
+static unsigned long    Random = 1;
+
+static unsigned char Percent( void )
+{
+    Random = Random * 1103515245ul + 12345;
+    return (Random >> 16) % 100;
+}
+
+static void TopUp( void )
+{
+    J1939_MESSAGE Msg;
+
+    Msg.Msg.Priority = 6;
+    Msg.Msg.DataPage = 0;
+    Msg.Msg.PDUFormat = 0xFF;
+    Msg.Msg.PDUSpecific = 0x10;
+    Msg.Msg.DataLength = 8;
+    while (Queued < MESSAGES)
+    {
+        Msg.Msg.Data[0] = Queued >> 8;
+        Msg.Msg.Data[1] = Queued;
+        if (J1939_EnqueueMessage( &Msg ) != RC_SUCCESS)
+            break;
+        Queued ++;
+    }
+}
+
+// The MCP2515 drives INT low while an enabled interrupt flag is set, and
+// the PIC interrupts on the falling edge.
+
+static void WatchInt( void )
+{
+    if (McpInt() && !IntLine)
+        IntAt = Now;
+    IntLine = McpInt();
+}
+
+static void RunISR( void )
+{
+    unsigned long Start = McpBytes;
+    unsigned char Before[3];
+    unsigned char Buffer;
+
+    for (Buffer = 0; Buffer < 3; Buffer++)
+        Before[Buffer] = McpReg[MCP_TXB0CTRL + (Buffer << 4)] & McpTXREQ;
+    IntAt = NEVER;
+    J1939_ISR();
+    for (Buffer = 0; Buffer < 3; Buffer++)
+        if (!Before[Buffer] && (McpReg[MCP_TXB0CTRL + (Buffer << 4)] & McpTXREQ))
+            ReadyAt[Buffer] = Now + (McpLoaded[Buffer] - Start) * SPI_BYTE_US;
+    CpuFree = Now + (McpBytes - Start) * SPI_BYTE_US;
+
+    // If the INT line is still low, it fell again while the ISR ran, so
+    // INTF is set and the ISR runs again.
+    IntLine = McpInt();
+    if (IntLine)
+        IntAt = CpuFree;
+    TopUp();
+    WatchInt();
+}
+
+static unsigned char ReadyBuffers( void )
+{
+    unsigned char Buffer;
+    unsigned char Ready = 0;
+
+    for (Buffer = 0; Buffer < 3; Buffer++)
+        if (ReadyAt[Buffer] <= Now)
+            Ready |= 0x04 << (Buffer << 1);
+    return Ready;
+}
+
+static int Drain( unsigned long BitRate, unsigned long Latency, unsigned char Other )
+{
+    unsigned long FrameTime = FRAME_BITS * 1000000ul / BitRate;
+    unsigned long Next;
+    unsigned long IsrAt;
+    unsigned long First = NEVER;
+    unsigned int  Expected = 0;
+    unsigned int  Sent = 0;
+    unsigned int  Foreign = 0;
+    unsigned char Lost = 0;
+    unsigned int  OutOfOrder = 0;
+    unsigned int  Number;
+    unsigned char Buffer;
+    unsigned char *Image;
+    signed char   OnBus;
+
+    // Start with the address claim sent and all transmit buffers free.
+    J1939_Initialization();
+    J1939_Flags.Flags.CannotClaimAddress = 0;
+    J1939_Flags.Flags.WaitingForAddressClaimContention = 0;
+    for (Buffer = 0; Buffer < 3; Buffer++)
+    {
+        McpReg[MCP_TXB0CTRL + (Buffer << 4)] = 0;
+        ReadyAt[Buffer] = 0;
+    }
+    McpReg[MCP_CANINTF] = MCP_TX0IF | MCP_TX1IF | MCP_TX2IF;
+    Now = 0;
+    CpuFree = 0;
+    BusEnd = NEVER;
+    IntAt = NEVER;
+    IntLine = 0;
+    Queued = 0;
+    TopUp();
+    WatchInt();
+
+    while (Sent < MESSAGES)
+    {
+        if ((BusEnd == NEVER) && Lost)
+        {
+            // Another node's frame.
+            BusEnd = Now + FrameTime;
+            Lost = 0;
+            if (First != NEVER)
+                Foreign ++;
+        }
+        else if (BusEnd == NEVER)
+        {
+            OnBus = McpBusStart( ReadyBuffers() );
+            if (OnBus >= 0)
+            {
+                BusEnd = Now + FrameTime;
+                Image = McpTXB( OnBus );
+                if (McpPF( Image ) == 0xFF)
+                {
+                    Number = (McpData( Image )[0] << 8) | McpData( Image )[1];
+                    if (Number != Expected)
+                        OutOfOrder ++;
+                    Expected = Number + 1;
+                    if (First == NEVER)
+                        First = Now;
+                }
+            }
+        }
+
+        // Move on to the next event: the end of the frame on the bus, the
+        // ISR, or a buffer becoming ready on an idle bus.
+        IsrAt = NEVER;
+        if (IntAt != NEVER)
+            IsrAt = (IntAt + Latency > CpuFree) ? IntAt + Latency : CpuFree;
+        Next = (BusEnd < IsrAt) ? BusEnd : IsrAt;
+        if (BusEnd == NEVER)
+            for (Buffer = 0; Buffer < 3; Buffer++)
+                if ((McpReg[MCP_TXB0CTRL + (Buffer << 4)] & McpTXREQ) &&
+                    (ReadyAt[Buffer] > Now) && (ReadyAt[Buffer] < Next))
+                    Next = ReadyAt[Buffer];
+        if (Next == NEVER)
+        {
+            printf( "stalled after %u messages\n", Sent );
+            return 1;
+        }
+        Now = Next;
+
+        if (Now == BusEnd)
+        {
+            if ((McpOnBus >= 0) && (McpPF( McpTXB( McpOnBus ) ) == 0xFF))
+                Sent ++;
+            McpBusEnd();
+            BusEnd = NEVER;
+            Lost = Percent() < Other;
+            WatchInt();
+        }
+        else if (Now == IsrAt)
+            RunISR();
+    }
+
+    printf( "%4lu kbit/s, latency %4lu us, %2u%% other traffic: %5.0f frames/s, bus %3.0f%% busy, %u out of order\n",
+            BitRate / 1000, Latency, Other, MESSAGES * 1e6 / (Now - First),
+            100.0 * (MESSAGES + Foreign) * FrameTime / (Now - First), OutOfOrder );
+    return OutOfOrder != 0;
+}
+
+int main( void )
+{
+    static const unsigned long BitRate[] = { 250000, 500000 };
+    static const unsigned long Latency[] = { 20, 100, 300, 600 };
+    unsigned char Rate;
+    unsigned char Wait;
+    unsigned char Other;
+    int Failed = 0;
+
+    #ifdef J1939_NM_TX_LANE
+        puts( "TXB0 and TXB1" );
+    #else
+        puts( "TXB0, TXB1, and TXB2" );
+    #endif
+    for (Other = 0; Other <= 30; Other += 30)
+        for (Rate = 0; Rate < 2; Rate++)
+            for (Wait = 0; Wait < 4; Wait++)
+                Failed |= Drain( BitRate[Rate], Latency[Wait], Other );
+    return Failed;
+}
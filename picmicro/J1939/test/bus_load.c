@@ -0,0 +1,47 @@
+/*
+Bus load measurement at 250 kbit/s.  One 8 byte frame is sent every
+millisecond for 3 s, which is about 142 of the 250 bits in each
+millisecond, so the load must read 56.8%.  After 1 s of silence the load
+must read 0 with the peak kept.  Then the transmit buffer reports a lost
+arbitration and an error for the two frames before, and a message that
+waits 5 ms in the transmit queue must be counted at its priority.
+*/
+#include "J1939.C"
+#include <stdio.h>
+BOOL CA_AcceptCommandedAddress(void){return TRUE;}
+static int Failed;
+#define CHECK(what, got, expect) do { printf("%-28s %lu (expect %lu)\n", what, (unsigned long)(got), (unsigned long)(expect)); \
+	if ((got) != (expect)) Failed = 1; } while (0)
+static void Send(J1939_MESSAGE *M)
+{
+	SendOneMessage(M);
+	RXB0CONbits.FILHIT3 = 0;             /* the frame is on the bus at once */
+}
+int main(void)
+{
+	J1939_MESSAGE M; J1939_BUS_LOAD L; int t;
+	J1939_Flags.CannotClaimAddress = 0;
+	M.PDUFormat = 0xFE; M.PDUSpecific = 0xF1; M.Priority = 6; M.DataLength = 8;
+	for (t=0; t<3000; t++) { Send(&M); BusLoadTick(1000); }
+	J1939_ReadBusLoad(&L, FALSE);
+	CHECK("load, 1 frame per ms", L.Load, 568);
+	CHECK("peak", L.PeakLoad, 568);
+	for (t=0; t<1000; t++) BusLoadTick(1000);
+	J1939_ReadBusLoad(&L, TRUE);
+	CHECK("load, idle 1 s", L.Load, 0);
+	CHECK("peak kept", L.PeakLoad, 568);
+	RXB0CON = 0x20; Send(&M);           /* TXLARB on the frame before */
+	RXB0CON = 0x10; Send(&M);           /* TXERR on the frame before */
+	RXB0CON = 0;
+	TXHead = 0; TXTail = J1939_TX_QUEUE_SIZE - 1; TXQueueCount = 0;
+	J1939_EnqueueMessage(&M);
+	for (t=0; t<5; t++) BusLoadTick(1000);
+	BusLoadWait();
+	J1939_ReadBusLoad(&L, FALSE);
+	CHECK("arbitration lost", L.ArbitrationLost, 1);
+	CHECK("transmit errors", L.TXErrors, 1);
+	CHECK("priority 6 wait total (us)", L.TXWaitTotal[6], 5000);
+	CHECK("priority 6 wait max (us)", L.TXWaitMax[6], 5000);
+	CHECK("priority 6 waits", L.TXWaitCount[6], 1);
+	return Failed;
+}
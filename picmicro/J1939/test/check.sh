@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Compiles the PIC18 J1939 library on the host without running it, using
+# the register model in p18cxxx.h, once for the settings of each example
+# and once more for each of those in ECAN legacy mode and with polling
+# and interrupts swapped.  Each argument is a set of extra gcc options,
+# such as "-DJ1939_MEASURE_BUS_LOAD=1 -DJ1939_BUS_BIT_RATE=250000l", and
+# is checked on its own.  With J1939_LOCK_FREE_QUEUES the queue sizes are
+# made 4.  Any warnings and errors are printed, except for the ones the
+# original interrupt routine and message tables give, and the one the
+# indented #if bodies give.
+#
+# Usage:  sh check.sh ["options" ...]      (default: no extra options)
+
+TEST=`cd \`dirname $0\` && pwd`
+LIB=`dirname $TEST`
+WORK=`mktemp -d`
+trap 'rm -rf $WORK' 0
+
+# C18 accepts J1939.C's second definition of BOOL, but gcc doesn't.
+sed '0,/typedef enum _BOOL/{/typedef enum _BOOL/d}' $LIB/J1939.C > $WORK/J1939.C
+
+[ $# -eq 0 ] && set -- ""
+STATUS=0
+for OPTIONS in "$@"; do
+	case $OPTIONS in
+	*LOCK_FREE*)	SIZES="s/_QUEUE_SIZE [0-9]*/_QUEUE_SIZE 4/" ;;
+	*)				SIZES="" ;;
+	esac
+	for EXAMPLE in $LIB/Examples/*; do
+		for VARIANT in default legacy swapped; do
+			case $VARIANT in
+			default)	CHANGE="" ;;
+			legacy)		CHANGE="s/ECAN_LEGACY_MODE J1939_FALSE/ECAN_LEGACY_MODE J1939_TRUE/" ;;
+			swapped)	CHANGE="s/POLL_ECAN J1939_TRUE/POLL_ECAN J1939_XX/; s/POLL_ECAN J1939_FALSE/POLL_ECAN J1939_TRUE/; s/J1939_XX/J1939_FALSE/" ;;
+			esac
+			sed "$SIZES
+$CHANGE" $EXAMPLE/j1939.def > $WORK/j1939.def
+			gcc -x c -std=gnu99 -fsyntax-only -Wall -Wno-unknown-pragmas -Wno-unused \
+				-Wno-missing-braces -Wno-dangling-else -Wno-misleading-indentation -I$WORK -I$TEST -I$LIB $OPTIONS $WORK/J1939.C > $WORK/out 2>&1 || STATUS=1
+			grep -E "error|warning" $WORK/out | sed "s|^|`basename $EXAMPLE` $VARIANT $OPTIONS: |"
+		done
+	done
+done
+exit $STATUS
@@ -0,0 +1,98 @@
+/*
+Spreading periodic messages with J1939_StartCyclic.  Ten messages are
+started at once, and J1939_Poll is called every millisecond for 10 s.
+The number queued in each millisecond is counted with every message due
+at once (aligned, which is what a main loop that sends them itself does)
+and with the phases the library picks (spread).  Then a message is
+polled late and must keep its phase and send the right number of times.
+The transmit queue holds 16 messages here, so it never limits the count.
+*/
+#include "J1939.C"
+#include <stdio.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL line %d\n", __LINE__); return 1; } } while (0)
+
+#define RUN_MS		10000
+
+// Over the late polls, 15 are 37 ms late and 85 are 3 ms apart.
+
+#define LATE_US		(15ul * 37000 + 85ul * 3000)
+
+static J1939_MESSAGE Msg[J1939_CYCLIC_MESSAGES];
+
+// Starts Count messages with the given periods, and returns the most
+// queued in one millisecond.
+
+static int Run( const char *Name, unsigned char Count, unsigned long *Periods, BOOL Spread )
+{
+	int Hist[20] = {0};
+	int Peak = 0;
+	int Queued;
+	unsigned char Cyclic;
+	unsigned int Time;
+
+	for (Cyclic = 0; Cyclic < J1939_CYCLIC_MESSAGES; Cyclic++)
+		CyclicMessage[Cyclic] = 0;
+	TXQueueCount = 0;
+	J1939_Flags.CannotClaimAddress = 0;
+	for (Cyclic = 0; Cyclic < Count; Cyclic++)
+	{
+		Msg[Cyclic].PDUFormat = 0xFF;
+		Msg[Cyclic].GroupExtension = Cyclic;
+		Msg[Cyclic].DataLength = 8;
+		J1939_StartCyclic( Cyclic, &Msg[Cyclic], Periods[Cyclic] );
+
+		// What a main loop does: all due at once.
+		if (!Spread)
+			CyclicTimeLeft[Cyclic] = 0;
+	}
+
+	for (Time = 0; Time < RUN_MS; Time++)
+	{
+		CyclicSend( Time ? 1000 : 0 );
+		Queued = TXQueueCount;
+		TXQueueCount = 0;
+		if (Queued > Peak)
+			Peak = Queued;
+		Hist[Queued] ++;
+	}
+
+	printf( "%-28s %s: peak %d per ms; ms with 0/1/2/3+ msgs: %d/%d/%d/%d\n", Name,
+		Spread ? "spread " : "aligned", Peak, Hist[0], Hist[1], Hist[2],
+		RUN_MS - Hist[0] - Hist[1] - Hist[2] );
+	return Peak;
+}
+
+int main( void )
+{
+	static unsigned long Same[10];
+	static unsigned long Mixed[10] = { 10000, 10000, 20000, 20000, 50000, 50000, 100000, 100000, 100000, 1000000 };
+	unsigned char Cyclic;
+	unsigned char Poll;
+	unsigned long Sent = 0;
+
+	for (Cyclic = 0; Cyclic < 10; Cyclic++)
+		Same[Cyclic] = 100000;
+	CHECK( Run( "10 x 100 ms", 10, Same, FALSE ) == 10 );
+	CHECK( Run( "10 x 100 ms", 10, Same, TRUE ) == 1 );
+	CHECK( Run( "10/20/50/100/1000 ms mix", 10, Mixed, FALSE ) == 10 );
+	CHECK( Run( "10/20/50/100/1000 ms mix", 10, Mixed, TRUE ) == 2 );
+
+	// The phase is kept when a poll is late, so the count is right.
+	for (Cyclic = 0; Cyclic < J1939_CYCLIC_MESSAGES; Cyclic++)
+		CyclicMessage[Cyclic] = 0;
+	J1939_StartCyclic( 0, &Msg[0], 100000 );
+	for (Poll = 0; Poll < 100; Poll++)
+	{
+		CyclicSend( (Poll % 7 == 0) ? 37000 : 3000 );
+		Sent += TXQueueCount;
+		TXQueueCount = 0;
+	}
+	printf( "late polls: %lu sends over ~%lu ms (expect %lu)\n", Sent, LATE_US / 1000, LATE_US / 100000 + 1 );
+	CHECK( Sent == LATE_US / 100000 + 1 );
+
+	puts( "cyclic ok" );
+	return 0;
+}
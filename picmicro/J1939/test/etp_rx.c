@@ -0,0 +1,279 @@
+/*
+Receiving an extended transport protocol message.  An ideal originator
+at 250 kbit/s feeds frames to TPReceive and reacts to the library's
+connection management replies.  Each frame is timed from its real length
+with stuff bits and the interframe space, so the throughput printed is
+what the CTS window allows on the bus.  Then the refused, busy, abort,
+and timeout paths are checked.
+
+Usage:  etp_rx [size [originator delay per CTS in us]]
+*/
+#include "J1939.C"
+#include <stdio.h>
+#include <stdlib.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL line %d\n", __LINE__); return 1; } } while (0)
+
+#define BIT_RATE	250000.0
+
+static double BusTime;					// seconds
+static double ReactCTS;					// originator's delay per CTS, seconds
+static unsigned long Frames;
+static unsigned long Chunks;
+static unsigned long Sink;
+static unsigned long Bad;
+static int Ended = -1;
+
+// The message we sent last, if TPReceive sent one.
+
+static unsigned char Got[J1939_DATA_LENGTH];
+static unsigned char GotLength;
+static unsigned char GotPF;
+static unsigned char GotDA;
+
+static unsigned int CRC15( unsigned char *Bits, int Count )
+{
+	unsigned int CRC = 0;
+	unsigned char Next;
+	int Loop;
+
+	for (Loop = 0; Loop < Count; Loop++)
+	{
+		Next = Bits[Loop] ^ ((CRC >> 14) & 1);
+		CRC = (CRC << 1) & 0x7FFF;
+		if (Next)
+			CRC ^= 0x4599;
+	}
+	return CRC;
+}
+
+// The length in bits of an extended data frame on the bus, from the start
+// of frame to the end of the interframe space.
+
+static int FrameBits( unsigned long Identifier, unsigned char Length, unsigned char *Data )
+{
+	unsigned char Bits[200];
+	unsigned int CRC;
+	unsigned char Last = 2;
+	int Count = 0;
+	int Run = 0;
+	int Stuffed = 0;
+	int Loop;
+
+	Bits[Count++] = 0;
+	for (Loop = 28; Loop >= 18; Loop--)
+		Bits[Count++] = (Identifier >> Loop) & 1;
+	Bits[Count++] = 1;							// SRR
+	Bits[Count++] = 1;							// IDE
+	for (Loop = 17; Loop >= 0; Loop--)
+		Bits[Count++] = (Identifier >> Loop) & 1;
+	Bits[Count++] = 0;							// RTR, r1, r0
+	Bits[Count++] = 0;
+	Bits[Count++] = 0;
+	for (Loop = 3; Loop >= 0; Loop--)
+		Bits[Count++] = (Length >> Loop) & 1;
+	for (Loop = 0; Loop < Length * 8; Loop++)
+		Bits[Count++] = (Data[Loop / 8] >> (7 - Loop % 8)) & 1;
+	CRC = CRC15( Bits, Count );
+	for (Loop = 14; Loop >= 0; Loop--)
+		Bits[Count++] = (CRC >> Loop) & 1;
+
+	// After five equal bits a complement is stuffed, which starts the
+	// next run.
+	for (Loop = 0; Loop < Count; Loop++)
+	{
+		if (Bits[Loop] == Last)
+			Run ++;
+		else
+		{
+			Last = Bits[Loop];
+			Run = 1;
+		}
+		if (Run == 5)
+		{
+			Stuffed ++;
+			Last = !Last;
+			Run = 1;
+		}
+	}
+
+	// CRC delimiter, ACK, end of frame, and interframe space
+	return Count + Stuffed + 1 + 2 + 7 + 3;
+}
+
+static void Bus( unsigned char Priority, unsigned char PF, unsigned char DA, unsigned char SA, unsigned char *Data )
+{
+	unsigned long Identifier;
+
+	Identifier = ((unsigned long) Priority << 26) | ((unsigned long) PF << 16) | ((unsigned long) DA << 8) | SA;
+	BusTime += FrameBits( Identifier, 8, Data ) / BIT_RATE;
+	Frames ++;
+}
+
+static void Inject( unsigned char PF, unsigned char SA, unsigned char *Data )
+{
+	unsigned char Loop;
+
+	Bus( 7, PF, J1939_Address, SA, Data );
+	OneMessage.DataPage = 0;
+	OneMessage.Priority = 7;
+	OneMessage.PDUFormat = PF;
+	OneMessage.DestinationAddress = J1939_Address;
+	OneMessage.SourceAddress = SA;
+	OneMessage.DataLength = 8;
+	for (Loop = 0; Loop < 8; Loop++)
+		OneMessage.Data[Loop] = Data[Loop];
+	RXB0CONbits.FILHIT3 = RXB0CONbits.RXRTRRO = 0;
+	GotLength = 0;
+	TPReceive();
+
+	if (RXB0CONbits.FILHIT3 || RXB0CONbits.RXRTRRO)
+	{
+		GotPF = ((SimRegs[0] & 7) << 5) | ((SimRegs[1] >> 3) & 0x1C) | (SimRegs[1] & 3);
+		GotDA = SimRegs[2];
+		GotLength = SimRegs[4] & 15;
+		for (Loop = 0; Loop < GotLength; Loop++)
+			Got[Loop] = SimRegs[5+Loop];
+		Bus( SimRegs[0] >> 5, GotPF, GotDA, SimRegs[3], Got );
+	}
+}
+
+static unsigned char Pattern( unsigned long Offset )
+{
+	return (unsigned char) (Offset * 7 + (Offset >> 8));
+}
+
+BOOL CA_ETPStart( unsigned char SA, unsigned char DataPage, unsigned char PF, unsigned char GE, unsigned long Size )
+{
+	Sink = 0;
+	Ended = -1;
+	return SA != 0x55;
+}
+
+void CA_ETPData( unsigned long Offset, unsigned char *Data, unsigned int Length )
+{
+	unsigned int Loop;
+
+	if (Offset != Sink)
+		Bad ++;
+	for (Loop = 0; Loop < Length; Loop++)
+		if (Data[Loop] != Pattern( Offset + Loop ))
+			Bad ++;
+	Sink += Length;
+	Chunks ++;
+}
+
+void CA_ETPEnd( BOOL Complete )
+{
+	Ended = Complete;
+}
+
+// The originator sends the RTS, and answers each CTS with a DPO and the
+// packets asked for, leaving out packet DropPacket if it isn't 0.
+// Returns 1 if the End of Message Acknowledge came back for Size bytes.
+
+static int Transfer( unsigned char SA, unsigned long Size, unsigned long DropPacket )
+{
+	unsigned char Data[8];
+	unsigned long Next;
+	unsigned long Packet;
+	unsigned long Offset;
+	unsigned char Count;
+	unsigned char Sequence;
+	unsigned char Loop;
+
+	Data[0] = J1939_ETP_RTS_CONTROL_BYTE;
+	Data[1] = Size;
+	Data[2] = Size >> 8;
+	Data[3] = Size >> 16;
+	Data[4] = Size >> 24;
+	Data[5] = 0x00;
+	Data[6] = 0xEF;
+	Data[7] = 0x00;
+	Inject( J1939_PF_ETP_CM, SA, Data );
+
+	while (GotLength && (GotPF == J1939_PF_ETP_CM) && (Got[0] == J1939_ETP_CTS_CONTROL_BYTE))
+	{
+		Count = Got[1];
+		Next = Got[2] | ((unsigned long) Got[3] << 8) | ((unsigned long) Got[4] << 16);
+		BusTime += ReactCTS;
+
+		Data[0] = J1939_ETP_DPO_CONTROL_BYTE;
+		Data[1] = Count;
+		Data[2] = Next - 1;
+		Data[3] = (Next - 1) >> 8;
+		Data[4] = (Next - 1) >> 16;
+		Data[5] = 0x00;
+		Data[6] = 0xEF;
+		Data[7] = 0x00;
+		Inject( J1939_PF_ETP_CM, SA, Data );
+
+		for (Sequence = 1; (Sequence <= Count) && (Sequence != 0); Sequence++)
+		{
+			Packet = Next - 1 + Sequence;
+			if (Packet == DropPacket)
+			{
+				DropPacket = 0;
+				continue;
+			}
+			Data[0] = Sequence;
+			for (Loop = 1; Loop < 8; Loop++)
+			{
+				Offset = (Packet - 1) * 7 + Loop - 1;
+				Data[Loop] = (Offset < Size) ? Pattern( Offset ) : 0xFF;
+			}
+			Inject( J1939_PF_ETP_DT, SA, Data );
+			if (GotLength)
+				break;
+		}
+		if (!GotLength)
+			return 0;
+	}
+	return GotLength && (Got[0] == J1939_ETP_EOMA_CONTROL_BYTE) &&
+		((Got[1] | ((unsigned long) Got[2] << 8) | ((unsigned long) Got[3] << 16) | ((unsigned long) Got[4] << 24)) == Size);
+}
+
+int main( int argc, char **argv )
+{
+	static unsigned char Refused[8] = { J1939_ETP_RTS_CONTROL_BYTE, 0x10, 0x27, 0, 0, 0x00, 0xEF, 0x00 };
+	unsigned long Size = 300000;
+	int Complete;
+
+	if (argc > 1)
+		Size = strtoul( argv[1], 0, 0 );
+	if (argc > 2)
+		ReactCTS = atof( argv[2] ) / 1e6;
+	J1939_Address = 128;
+	ETPState = ETP_FREE;
+
+	Complete = Transfer( 0x20, Size, 0 );
+	printf( "window %3d size %lu: eoma %s, end %d, sink %lu, bad %lu, chunks %lu, frames %lu, bus %.3f s, %.0f B/s\n",
+		J1939_ETP_CTS_PACKETS, Size, Complete ? "ok" : "MISSING", Ended, Sink, Bad, Chunks, Frames,
+		BusTime, Size / BusTime );
+	CHECK( Complete && (Ended == 1) && (Sink == Size) && (Bad == 0) );
+
+	// The CA refuses messages from 0x55.
+	Inject( J1939_PF_ETP_CM, 0x55, Refused );
+	CHECK( GotLength && (Got[0] == J1939_CONNABORT_CONTROL_BYTE) && (Got[1] == J1939_ABORT_RESOURCES) && (GotDA == 0x55) );
+
+	// There is one session, so a second sender is told we're busy.
+	Inject( J1939_PF_ETP_CM, 0x21, Refused );
+	Inject( J1939_PF_ETP_CM, 0x22, Refused );
+	CHECK( GotLength && (Got[0] == J1939_CONNABORT_CONTROL_BYTE) && (Got[1] == J1939_ABORT_BUSY) && (GotDA == 0x22) );
+
+	Refused[0] = J1939_CONNABORT_CONTROL_BYTE;
+	Inject( J1939_PF_ETP_CM, 0x21, Refused );
+	CHECK( (Ended == 0) && (ETPState == ETP_FREE) );
+
+	// A lost packet leaves the session waiting until T1 runs out.
+	CHECK( !Transfer( 0x20, 10000, 5 ) );
+	RXB0CONbits.FILHIT3 = RXB0CONbits.RXRTRRO = 0;
+	TPSessionTimer( TP_T1 + 1 );
+	CHECK( (Ended == 0) && (ETPState == ETP_FREE) && (RXB0CONbits.FILHIT3 || RXB0CONbits.RXRTRRO) );
+	CHECK( (SimRegs[5] == J1939_CONNABORT_CONTROL_BYTE) && (SimRegs[6] == J1939_ABORT_TIMEOUT) );
+
+	puts( "refuse/busy/abort/timeout ok" );
+	return 0;
+}
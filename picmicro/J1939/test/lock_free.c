@@ -0,0 +1,159 @@
+/*
+Stress test of J1939_LOCK_FREE_QUEUES.  A timer signal stands in for the
+ECAN interrupt, so J1939_ISR runs at arbitrary points of the CA's calls
+to J1939_EnqueueMessage and J1939_DequeueMessage, with neither side
+disabling the other.  On each interrupt the ECAN module receives the
+next numbered message once the receive queue has room for it, and the
+transmit buffer sends the message the library loaded last time.  The CA
+queues numbered messages for transmission and takes received ones out,
+pausing for a random time before each call.
+
+Every message must come out once, in order, in each direction.  run.sh
+builds this with each queue size from 1 to 128.
+*/
+#include "J1939.C"
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define MESSAGES	20000u
+
+// The numbers that came out of one direction.  A number lower than the
+// highest one so far is either a repeat or out of order.
+
+struct TALLY {
+	unsigned char	Seen[MESSAGES];
+	unsigned int	Next;
+	unsigned int	Count;
+	unsigned int	Repeated;
+	unsigned int	OutOfOrder;
+};
+
+static volatile struct TALLY	Received;
+static volatile struct TALLY	Sent;
+static volatile unsigned int	RXLoaded;
+static volatile unsigned long	Interrupts;
+
+static void Arrived( volatile struct TALLY *Tally, unsigned char *Data )
+{
+	unsigned int Number = (Data[0] << 8) | Data[1];
+
+	if (Number >= MESSAGES)
+		Tally->Repeated ++;
+	else if (Tally->Seen[Number])
+		Tally->Repeated ++;
+	else
+	{
+		if (Number < Tally->Next)
+			Tally->OutOfOrder ++;
+		else
+			Tally->Next = Number + 1;
+		Tally->Seen[Number] = 1;
+		Tally->Count ++;
+	}
+}
+
+// Waits a random time of up to about one interrupt period, so the
+// interrupts land anywhere in the CA's calls rather than always at the
+// same point after the last one.
+
+static void Pause( void )
+{
+	volatile unsigned int Spin = rand() % 8000;
+
+	while (Spin != 0)
+		Spin --;
+}
+
+static int Report( const char *Direction, volatile struct TALLY *Tally )
+{
+	printf( "  %s: %u lost, %u repeated, %u out of order\n", Direction,
+			MESSAGES - Tally->Count, Tally->Repeated, Tally->OutOfOrder );
+	return (Tally->Count != MESSAGES) || Tally->Repeated || Tally->OutOfOrder;
+}
+
+static void Interrupt( int Signal )
+{
+	if ((RXLoaded < MESSAGES) && (RXQueueCount < J1939_RX_QUEUE_SIZE))
+	{
+		SimRegs[0] = (6 << 5) | 0x07;			// Priority 6, PGN 0xFF10
+		SimRegs[1] = 0xE8 | 0x03;
+		SimRegs[2] = 0x10;
+		SimRegs[3] = 0x20;
+		SimRegs[4] = 8;
+		SimRegs[5] = RXLoaded >> 8;
+		SimRegs[6] = RXLoaded;
+		RXB0CON = 0;							// Broadcast filter
+		RXB0CONbits.RXFUL = 1;
+		COMSTAT |= FIFOEMPTY_MASK;
+		PIR3bits.RXBnIF = 1;
+		RXLoaded ++;
+	}
+	PIR3bits.TXBnIF = 1;
+
+	J1939_ISR();
+	Interrupts ++;
+
+	if (RXB0CONbits.FILHIT3)
+	{
+		Arrived( &Sent, &SimRegs[5] );
+		RXB0CONbits.FILHIT3 = 0;
+	}
+}
+
+int main( void )
+{
+	struct sigaction Action;
+	struct itimerval Timer;
+	J1939_MESSAGE Out;
+	J1939_MESSAGE In;
+	unsigned int Queued = 0;
+	time_t Start;
+	int Failed;
+
+	J1939_Flags.CannotClaimAddress = 0;
+	J1939_Address = 0x80;
+	TXHead = TXTail = RXHead = RXTail = 0;
+
+	Action.sa_handler = Interrupt;
+	Action.sa_flags = SA_RESTART;
+	sigemptyset( &Action.sa_mask );
+	sigaction( SIGALRM, &Action, NULL );
+	Timer.it_interval.tv_sec = 0;
+	Timer.it_interval.tv_usec = 20;
+	Timer.it_value = Timer.it_interval;
+	setitimer( ITIMER_REAL, &Timer, NULL );
+
+	Out.Priority = 6;
+	Out.DataPage = 0;
+	Out.PDUFormat = 0xFF;
+	Out.PDUSpecific = 0x11;
+	Out.DataLength = 8;
+
+	Start = time( NULL );
+	while (((Received.Next < MESSAGES) || (Sent.Next < MESSAGES)) && (time( NULL ) < Start + 20))
+	{
+		Pause();
+		if (Queued < MESSAGES)
+		{
+			Out.Data[0] = Queued >> 8;
+			Out.Data[1] = Queued;
+			if (J1939_EnqueueMessage( &Out ) == RC_SUCCESS)
+				Queued ++;
+		}
+		Pause();
+		if (J1939_DequeueMessage( &In ) == RC_SUCCESS)
+			Arrived( &Received, In.Data );
+	}
+
+	Timer.it_value.tv_usec = 0;
+	setitimer( ITIMER_REAL, &Timer, NULL );
+	printf( "queues of %u, %lu interrupts\n", J1939_RX_QUEUE_SIZE, Interrupts );
+	Failed = Report( "receive", &Received );
+	Failed |= Report( "transmit", &Sent );
+	return Failed;
+}
@@ -0,0 +1,35 @@
+/*
+p18cxxx.h
+
+Host model of the C18 p18cxxx.h, so the simulations in this directory
+can include J1939.C and run it with gcc.  The registers the library uses
+are plain variables.  The transmit and receive buffer registers from
+RXB0SIDH on are the array SimRegs, since the library reaches them through
+a pointer.  The MAPPED_TXREQ bit (FILHIT3, or RXRTRRO for the legacy CAN
+module) stays set after a message is sent, so a simulation must clear it
+before the library sends again.
+*/
+#ifndef __p18cxxx_h
+#define __p18cxxx_h
+
+unsigned char SimRegs[16];
+#define RXB0SIDH SimRegs[0]
+#define rom const
+
+typedef struct { unsigned RXFUL:1, FILHIT3:1, RXRTRRO:1, TXREQ:1; } CONbits_t;
+CONbits_t RXB0CONbits;
+unsigned char TXERRCNT, RXERRCNT, RXB0CON, COMSTAT, CANCON, CANSTAT, ECANCON;
+unsigned char PIE3, PIR3, TXBIE, BIE0, BSEL0, IPR3;
+struct { unsigned RXBnIE:1, TXBnIE:1, TXB0IE:1, TXB1IE:1; } PIE3bits;
+struct { unsigned RXBnIF:1, TXBnIF:1, TXB0IF:1, TXB1IF:1, ERRIF:1, IRXIF:1; } PIR3bits;
+struct { unsigned TXB1IE:1; } TXBIEbits;
+struct { unsigned TRISB2:1, TRISB3:1; } TRISBbits;
+struct { unsigned TRISG3:1; } TRISGbits;
+struct { unsigned IPEN:1; } RCONbits;
+struct { unsigned GIEL:1, GIEH:1; } INTCONbits;
+unsigned char RXM0SIDH, RXM0SIDL, RXM0EIDH, RXM0EIDL, RXM1SIDH, RXM1SIDL, RXM1EIDH, RXM1EIDL;
+unsigned char RXF0SIDH, RXF0SIDL, RXF1SIDH, RXF1SIDL, RXF2SIDL, RXF2EIDH, RXF3SIDL, RXF3EIDH;
+unsigned char RXF4SIDL, RXF4EIDH, RXF5SIDL, RXF5EIDH;
+unsigned char MSEL0, RXFBCON0, RXFBCON1, RXFBCON2, RXFCON0, RXFCON1, BRGCON1, BRGCON2, BRGCON3;
+
+#endif
@@ -0,0 +1,115 @@
+/*
+Answering requests with J1939_SetResponder: cached, built, and NACKed
+responses, PDU1 and PDU2 PGNs, global and addressed requests,
+unregistered PGNs, and parameter errors.
+*/
+#include "J1939.C"
+#include <stdio.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL line %d\n", __LINE__); return 1; } } while (0)
+
+static int Builds;
+
+// The message we sent last.
+
+static BOOL Sent;
+static unsigned char SentPriority;
+static unsigned char SentPF;
+static unsigned char SentDA;
+static unsigned char SentSA;
+static unsigned char SentLength;
+static unsigned char SentData[J1939_DATA_LENGTH];
+
+BOOL CA_BuildResponse( unsigned char Responder, J1939_MESSAGE *MsgPtr )
+{
+	Builds ++;
+	MsgPtr->Data[0] = 0x42;
+	MsgPtr->DataLength = 1;
+	return Responder == 1;
+}
+
+static BOOL Request( unsigned char Destination, unsigned char Source,
+	unsigned char PGN0, unsigned char PGN1, unsigned char PGN2 )
+{
+	BOOL Answered;
+	unsigned char Loop;
+
+	OneMessage.PDUFormat = J1939_PF_REQUEST;
+	OneMessage.DestinationAddress = Destination;
+	OneMessage.SourceAddress = Source;
+	OneMessage.DataLength = 3;
+	OneMessage.Data[0] = PGN0;
+	OneMessage.Data[1] = PGN1;
+	OneMessage.Data[2] = PGN2;
+	RXB0CONbits.FILHIT3 = RXB0CONbits.RXRTRRO = 0;
+	Answered = RespondToRequest();
+
+	Sent = RXB0CONbits.FILHIT3 || RXB0CONbits.RXRTRRO;
+	SentPriority = SimRegs[0] >> 5;
+	SentPF = ((SimRegs[0] & 7) << 5) | ((SimRegs[1] >> 3) & 0x1C) | (SimRegs[1] & 3);
+	SentDA = SimRegs[2];
+	SentSA = SimRegs[3];
+	SentLength = SimRegs[4] & 15;
+	for (Loop = 0; Loop < J1939_DATA_LENGTH; Loop++)
+		SentData[Loop] = SimRegs[5+Loop];
+	return Answered;
+}
+
+int main( void )
+{
+	J1939_MESSAGE Msg = {0};
+	unsigned char Loop;
+
+	J1939_Address = 128;
+	J1939_Flags.CannotClaimAddress = 0;
+	for (Loop = 0; Loop < J1939_RESPONDERS; Loop++)
+		ResponderMode[Loop] = J1939_RESPOND_CLOSED;
+	CHECK( !Request( 128, 9, 0x04, 0xF0, 0x00 ) );
+
+	// PDU2 PGN, from the cache
+	Msg.Priority = 3;
+	Msg.PDUFormat = 0xF0;
+	Msg.GroupExtension = 0x04;
+	Msg.DataLength = 8;
+	for (Loop = 0; Loop < 8; Loop++)
+		Msg.Data[Loop] = Loop + 1;
+	CHECK( J1939_SetResponder( 0, &Msg, J1939_RESPOND_CACHED ) == RC_SUCCESS );
+	CHECK( Request( 128, 9, 0x04, 0xF0, 0x00 ) && Sent );
+	CHECK( SentPF == 0xF0 && SentDA == 0x04 && SentSA == 128 );
+	CHECK( SentLength == 8 && SentData[7] == 8 && SentPriority == 3 );
+	CHECK( Request( 255, 9, 0x04, 0xF0, 0x00 ) && Sent && SentPF == 0xF0 );
+	CHECK( !Request( 128, 9, 0x05, 0xF0, 0x00 ) );
+
+	CHECK( J1939_SetResponder( 0, &Msg, J1939_RESPOND_NACK ) == RC_SUCCESS );
+	CHECK( Request( 128, 9, 0x04, 0xF0, 0x00 ) && Sent );
+	CHECK( SentPF == J1939_PF_ACKNOWLEDGMENT && SentDA == 9 && SentPriority == 6 );
+	CHECK( SentData[0] == 1 && SentData[5] == 4 && SentData[6] == 0xF0 && SentData[7] == 0 );
+	CHECK( Request( 255, 9, 0x04, 0xF0, 0x00 ) && !Sent );
+
+	// PDU1 PGN, built by the CA
+	Msg.PDUFormat = 0xEF;
+	Msg.DestinationAddress = 0x77;
+	Msg.DataPage = 1;
+	CHECK( J1939_SetResponder( 1, &Msg, J1939_RESPOND_BUILD ) == RC_SUCCESS );
+	CHECK( Request( 128, 9, 0x00, 0xEF, 0x01 ) && Sent );
+	CHECK( SentPF == 0xEF && SentDA == 9 && SentLength == 1 && SentData[0] == 0x42 && (SimRegs[0] & 0x08) );
+	CHECK( Request( 255, 9, 0x00, 0xEF, 0x01 ) && Sent && SentDA == 255 );
+	CHECK( !Request( 128, 9, 0x00, 0xEF, 0x00 ) );
+
+	// Responder 2 builds a NACK.
+	CHECK( J1939_SetResponder( 2, &Msg, J1939_RESPOND_BUILD ) == RC_SUCCESS );
+	CHECK( J1939_SetResponder( 1, &Msg, J1939_RESPOND_CLOSED ) == RC_SUCCESS );
+	CHECK( Request( 128, 9, 0x00, 0xEF, 0x01 ) && Sent && SentPF == J1939_PF_ACKNOWLEDGMENT );
+	CHECK( SentData[5] == 0 && SentData[6] == 0xEF && SentData[7] == 1 );
+
+	CHECK( J1939_SetResponder( 3, &Msg, J1939_RESPOND_CACHED ) == RC_PARAMERROR );
+	CHECK( J1939_SetResponder( 0, &Msg, 4 ) == RC_PARAMERROR );
+
+	J1939_Flags.CannotClaimAddress = 1;
+	CHECK( !Request( 128, 9, 0x04, 0xF0, 0x00 ) );
+
+	printf( "responders ok, %d builds\n", Builds );
+	return 0;
+}
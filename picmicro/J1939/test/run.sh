@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Host simulations of the PIC18 J1939 library.  Each simulation includes
+# J1939.C with the register model in p18cxxx.h and the settings in
+# Examples/Example1a/j1939.def, changed as listed below, and exits
+# with a nonzero status if a check fails.
+#
+# A number at the end of a simulation's name is passed as its main
+# option, so etp_rx64 runs etp_rx.c with a CTS window of 64 packets, and
+# lock_free16 runs lock_free.c with queues of 16 messages.
+#
+# Usage:  sh run.sh [simulation ...]       (default: all of them)
+
+TEST=`cd \`dirname $0\` && pwd`
+LIB=`dirname $TEST`
+WORK=`mktemp -d`
+trap 'rm -rf $WORK' 0
+
+# C18 accepts J1939.C's second definition of BOOL, but gcc doesn't.
+sed '0,/typedef enum _BOOL/{/typedef enum _BOOL/d}' $LIB/J1939.C > $WORK/J1939.C
+
+options()
+{
+	case $1 in
+	tp_tx)		echo "-DJ1939_TP_RX_SESSIONS=1 -DJ1939_TP_TX=1" ;;
+	tp_rx)		echo "-DJ1939_TP_RX_SESSIONS=2 -DJ1939_TP_CTS_PACKETS=4" ;;
+	etp_rx*)	echo "-DJ1939_TP_RX_SESSIONS=1 -DJ1939_ETP_RX=1 -DJ1939_ETP_CTS_PACKETS=${1#etp_rx}" ;;
+	responders)	echo "-DJ1939_RESPONDERS=3 -DJ1939_RESPONSE_BUILDER=1" ;;
+	cyclic)		echo "-DJ1939_CYCLIC_MESSAGES=10" ;;
+	bus_load)	echo "-DJ1939_MEASURE_BUS_LOAD=1 -DJ1939_BUS_BIT_RATE=250000l" ;;
+	tx_bins*)	echo "-DJ1939_TX_PRIORITY_BINS=${1#tx_bins}" ;;
+	lock_free*)	echo "-DJ1939_LOCK_FREE_QUEUES=1" ;;
+	esac
+}
+
+# Changes to Example1a's settings, as a sed script.
+
+settings()
+{
+	case $1 in
+	cyclic|tx_bins*)	echo "s/J1939_TX_QUEUE_SIZE 3/J1939_TX_QUEUE_SIZE 16/" ;;
+	lock_free*)	echo "s/_QUEUE_SIZE 3/_QUEUE_SIZE ${1#lock_free}/; s/POLL_ECAN J1939_TRUE/POLL_ECAN J1939_FALSE/" ;;
+	esac
+}
+
+SIMS=${*:-"tp_tx tp_rx etp_rx16 etp_rx64 etp_rx255 responders cyclic bus_load tx_bins0 tx_bins1
+	lock_free1 lock_free2 lock_free4 lock_free8 lock_free16 lock_free32 lock_free64 lock_free128"}
+STATUS=0
+for SIM in $SIMS; do
+	echo "== $SIM"
+	mkdir $WORK/$SIM
+	sed "`settings $SIM`" $LIB/Examples/Example1a/j1939.def > $WORK/$SIM/j1939.def
+	gcc -std=gnu99 -Wall -Wno-unknown-pragmas -Wno-unused -Wno-missing-braces \
+		-Wno-dangling-else -Wno-misleading-indentation -I$WORK -I$WORK/$SIM -I$TEST -I$LIB \
+		`options $SIM` $TEST/`echo $SIM | sed 's/[0-9]*$//'`.c -o $WORK/$SIM/sim &&
+		$WORK/$SIM/sim || STATUS=1
+done
+exit $STATUS
@@ -0,0 +1,192 @@
+/*
+Receiving transport protocol messages with two sessions and a CTS window
+of 4 packets.  Two connection mode transfers from different sources are
+interleaved, with the window asked for in each RTS clamped to 4, and a
+data packet out of sequence must be dropped.  An RTS must be refused
+while both buffers hold messages the CA hasn't released, and
+J1939_PeekTPMessage must return each message until it is released.  A
+BAM is reassembled without any replies, a session that misses its next
+data packet is dropped after T1, and one whose sender doesn't answer a
+CTS is aborted after T2.
+*/
+#include "J1939.C"
+#include <stdio.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL line %d\n", __LINE__); return 1; } } while (0)
+
+static unsigned char Packet[J1939_DATA_LENGTH];
+static BOOL Replied;
+
+static unsigned char Byte( unsigned char Source, unsigned int Offset )
+{
+	return Source + Offset * 3;
+}
+
+static void Receive( unsigned char Source, unsigned char Destination, unsigned char PDUFormat )
+{
+	unsigned char Loop;
+
+	OneMessage.DataPage = 0;
+	OneMessage.Priority = 7;
+	OneMessage.PDUFormat = PDUFormat;
+	OneMessage.DestinationAddress = Destination;
+	OneMessage.SourceAddress = Source;
+	OneMessage.DataLength = J1939_DATA_LENGTH;
+	for (Loop = 0; Loop < J1939_DATA_LENGTH; Loop++)
+		OneMessage.Data[Loop] = Packet[Loop];
+	RXB0CONbits.FILHIT3 = RXB0CONbits.RXRTRRO = 0;
+	TPReceive();
+	Replied = RXB0CONbits.FILHIT3;
+	RXB0CONbits.FILHIT3 = 0;
+}
+
+// Starts a message of Length bytes with PGN 0xEF00 sent to us, or with
+// PGN 0xFEF1 sent to the global address.
+
+static void Start( unsigned char Control, unsigned char Source, unsigned int Length, unsigned char Window )
+{
+	Packet[0] = Control;
+	Packet[1] = Length & 0xFF;
+	Packet[2] = Length >> 8;
+	Packet[3] = (Length + 6) / 7;
+	Packet[4] = Window;
+	Packet[7] = 0x00;
+	if (Control == J1939_BAM_CONTROL_BYTE)
+	{
+		Packet[5] = 0xF1;
+		Packet[6] = 0xFE;
+		Receive( Source, J1939_GLOBAL_ADDRESS, J1939_PF_TP_CM );
+	}
+	else
+	{
+		Packet[5] = 0x00;
+		Packet[6] = 0xEF;
+		Receive( Source, J1939_Address, J1939_PF_TP_CM );
+	}
+}
+
+static void Data( unsigned char Source, unsigned char Destination, unsigned char Number )
+{
+	unsigned char Loop;
+
+	Packet[0] = Number;
+	for (Loop = 1; Loop < J1939_DATA_LENGTH; Loop++)
+		Packet[Loop] = Byte( Source, (Number - 1) * 7 + Loop - 1 );
+	Receive( Source, Destination, J1939_PF_DT );
+}
+
+// Checks the connection management message we sent last.
+
+static int Sent( unsigned char Destination, unsigned char Control, unsigned char Byte1, unsigned char Byte2 )
+{
+	return Replied && (SimRegs[2] == Destination) &&
+		(SimRegs[5] == Control) && (SimRegs[6] == Byte1) && (SimRegs[7] == Byte2);
+}
+
+static int Peeked( unsigned char Source, unsigned char PDUFormat, unsigned char PDUSpecific, unsigned int Length )
+{
+	J1939_TP_MESSAGE Msg;
+	unsigned int Offset;
+
+	if ((J1939_PeekTPMessage( &Msg ) != RC_SUCCESS) || (Msg.SourceAddress != Source) ||
+		(Msg.PDUFormat != PDUFormat) || (Msg.PDUSpecific != PDUSpecific) || (Msg.DataLength != Length))
+		return 0;
+	for (Offset = 0; Offset < Length; Offset++)
+		if (Msg.Data[Offset] != Byte( Source, Offset ))
+			return 0;
+	return 1;
+}
+
+int main( void )
+{
+	J1939_TP_MESSAGE Msg;
+
+	J1939_Address = 0x80;
+	TPSession[0].State = TPSession[1].State = TP_FREE;
+	TPPeeked = TP_NO_SESSION;
+
+	// 0x20 sends 30 bytes with no window limit, and 0x21 sends 20 bytes
+	// 2 packets at a time.
+	Start( J1939_RTS_CONTROL_BYTE, 0x20, 30, 0xFF );
+	CHECK( Sent( 0x20, J1939_CTS_CONTROL_BYTE, 4, 1 ) );
+	Start( J1939_RTS_CONTROL_BYTE, 0x21, 20, 2 );
+	CHECK( Sent( 0x21, J1939_CTS_CONTROL_BYTE, 2, 1 ) );
+	Data( 0x20, 0x80, 1 );
+	CHECK( !Replied );
+	Data( 0x21, 0x80, 1 );
+	Data( 0x21, 0x80, 2 );
+	CHECK( Sent( 0x21, J1939_CTS_CONTROL_BYTE, 1, 3 ) );
+
+	Packet[0] = 3;
+	Packet[1] = 0xEE;
+	Receive( 0x20, 0x80, J1939_PF_DT );
+	CHECK( !Replied && (TPSession[0].NextPacket == 2) );
+
+	Data( 0x20, 0x80, 2 );
+	Data( 0x20, 0x80, 3 );
+	Data( 0x20, 0x80, 4 );
+	CHECK( Sent( 0x20, J1939_CTS_CONTROL_BYTE, 1, 5 ) );
+	Data( 0x21, 0x80, 3 );
+	CHECK( Sent( 0x21, J1939_EOMACK_CONTROL_BYTE, 20, 0 ) );
+	Data( 0x20, 0x80, 5 );
+	CHECK( Sent( 0x20, J1939_EOMACK_CONTROL_BYTE, 30, 0 ) );
+
+	// Both buffers hold a message, so there is no room for another.
+	Start( J1939_RTS_CONTROL_BYTE, 0x22, 20, 0 );
+	CHECK( Sent( 0x22, J1939_CONNABORT_CONTROL_BYTE, J1939_ABORT_BUSY, 0xFF ) );
+
+	CHECK( Peeked( 0x20, 0xEF, 0x80, 30 ) );
+	CHECK( Peeked( 0x20, 0xEF, 0x80, 30 ) );
+	J1939_ReleaseTPMessage();
+	CHECK( Peeked( 0x21, 0xEF, 0x80, 20 ) );
+	J1939_ReleaseTPMessage();
+	CHECK( J1939_PeekTPMessage( &Msg ) == RC_QUEUEEMPTY );
+
+	// A window of 0 in the RTS also means no limit.
+	Start( J1939_RTS_CONTROL_BYTE, 0x22, 50, 0 );
+	CHECK( Sent( 0x22, J1939_CTS_CONTROL_BYTE, 4, 1 ) );
+	Packet[0] = J1939_CONNABORT_CONTROL_BYTE;
+	Receive( 0x22, 0x80, J1939_PF_TP_CM );
+	CHECK( TPSession[0].State == TP_FREE );
+
+	Start( J1939_BAM_CONTROL_BYTE, 0x30, 17, 0xFF );
+	Data( 0x30, J1939_GLOBAL_ADDRESS, 1 );
+	Data( 0x30, J1939_GLOBAL_ADDRESS, 2 );
+	Data( 0x30, J1939_GLOBAL_ADDRESS, 3 );
+	CHECK( !Replied );
+	CHECK( Peeked( 0x30, 0xFE, 0xF1, 17 ) );
+	J1939_ReleaseTPMessage();
+
+	// T1: a BAM is dropped quietly, and a connection mode transfer is
+	// aborted.
+	Start( J1939_BAM_CONTROL_BYTE, 0x31, 17, 0xFF );
+	Data( 0x31, J1939_GLOBAL_ADDRESS, 1 );
+	Start( J1939_RTS_CONTROL_BYTE, 0x32, 20, 2 );
+	Data( 0x32, 0x80, 1 );
+	CHECK( !Replied );
+	TPSessionTimer( TP_T1 - 1 );
+	CHECK( (TPSession[0].State == TP_BAM) && (TPSession[1].State == TP_RTS) );
+	RXB0CONbits.FILHIT3 = 0;
+	TPSessionTimer( 1 );
+	Replied = RXB0CONbits.FILHIT3;
+	CHECK( (TPSession[0].State == TP_FREE) && (TPSession[1].State == TP_FREE) );
+	CHECK( Sent( 0x32, J1939_CONNABORT_CONTROL_BYTE, J1939_ABORT_TIMEOUT, 0xFF ) );
+	Data( 0x31, J1939_GLOBAL_ADDRESS, 2 );
+	CHECK( J1939_PeekTPMessage( &Msg ) == RC_QUEUEEMPTY );
+
+	// T2: after a CTS, the sender has longer than T1 to answer.
+	Start( J1939_RTS_CONTROL_BYTE, 0x33, 20, 0xFF );
+	CHECK( Sent( 0x33, J1939_CTS_CONTROL_BYTE, 3, 1 ) );
+	TPSessionTimer( TP_T1 );
+	CHECK( TPSession[0].State == TP_RTS );
+	RXB0CONbits.FILHIT3 = 0;
+	TPSessionTimer( TP_T2 - TP_T1 );
+	Replied = RXB0CONbits.FILHIT3;
+	CHECK( TPSession[0].State == TP_FREE );
+	CHECK( Sent( 0x33, J1939_CONNABORT_CONTROL_BYTE, J1939_ABORT_TIMEOUT, 0xFF ) );
+
+	puts( "tp_rx ok" );
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+Sending a connection mode transfer: a 1785 byte message (255 packets) in
+one window must stop after packet 255 and wait for the End of Message
+Acknowledge, and a CTS for a packet the message doesn't have must abort
+the transfer.
+*/
+#include "J1939.C"
+#include <stdio.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL line %d\n", __LINE__); return 1; } } while (0)
+
+static unsigned char Buffer[1785];
+
+static void CTS( unsigned char Count, unsigned char Next )
+{
+	OneMessage.SourceAddress = 0x20;
+	OneMessage.DestinationAddress = J1939_Address;
+	OneMessage.Data[0] = J1939_CTS_CONTROL_BYTE;
+	OneMessage.Data[1] = Count;
+	OneMessage.Data[2] = Next;
+	OneMessage.Data[5] = 0x00;
+	OneMessage.Data[6] = 0xEF;
+	OneMessage.Data[7] = 0x00;
+	TPTxReceive();
+	RXB0CONbits.FILHIT3 = RXB0CONbits.RXRTRRO = 0;
+}
+
+static int SendWindow( void )
+{
+	int Sent = 0;
+
+	while (TP_TX_READY && (Sent < 1000))
+	{
+		TPTxSendPacket();
+		RXB0CONbits.FILHIT3 = RXB0CONbits.RXRTRRO = 0;
+		Sent ++;
+	}
+	return Sent;
+}
+
+int main( void )
+{
+	J1939_Address = 0x80;
+	TPTxData = Buffer;
+	TPTxLength = sizeof(Buffer);
+	TPTxPackets = 255;
+	TPTxDestination = 0x20;
+	TPTxPGN[0] = 0x00;
+	TPTxPGN[1] = 0xEF;
+	TPTxPGN[2] = 0x00;
+
+	TPTxState = TPTX_WAIT_CTS;
+	CTS( 255, 1 );
+	CHECK( SendWindow() == 255 );
+	CHECK( TPTxState == TPTX_WAIT_EOMACK );
+
+	TPTxState = TPTX_WAIT_CTS;
+	CTS( 16, 250 );
+	CHECK( SendWindow() == 6 );
+	CHECK( TPTxState == TPTX_WAIT_EOMACK );
+
+	TPTxState = TPTX_WAIT_CTS;
+	CTS( 16, 0 );
+	CHECK( TPTxState == TPTX_IDLE && J1939_Flags.TPSendFailed );
+	CHECK( SimRegs[5] == J1939_CONNABORT_CONTROL_BYTE && SimRegs[6] == J1939_ABORT_BAD_SEQUENCE );
+
+	puts( "tp_tx ok" );
+	return 0;
+}
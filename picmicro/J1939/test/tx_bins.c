@@ -0,0 +1,152 @@
+/*
+Waiting time in the transmit queue, by J1939 priority, at 250 kbit/s.
+For 10 s the CA queues a priority 3 message every 10 ms, two priority 6
+messages every 50 ms, a block of 12 priority 6 messages every 100 ms, and
+a priority 7 message every 20 ms.  One message leaves the queue per 8
+byte frame time (568 us), the way J1939_TransmitMessages takes them for
+each free buffer.  The worst wait of each priority is printed.
+
+Run as tx_bins0 the queue is one FIFO, so the priority 3 message can
+wait behind the block.  Run as tx_bins1 (J1939_TX_PRIORITY_BINS) it must
+never wait longer than the frame already on the bus plus one frame time.
+Either way the messages of each priority must go out in order.
+*/
+#include "J1939.C"
+#include <stdio.h>
+
+BOOL CA_AcceptCommandedAddress( void ) { return TRUE; }
+
+#define CHECK(c) do { if (!(c)) { printf("FAIL line %d\n", __LINE__); return 1; } } while (0)
+
+#define FRAME_US	568ul
+#define RUN_US		10000000ul
+
+struct TRAFFIC {
+	unsigned char	Priority;
+	unsigned char	Count;
+	unsigned long	Period;
+	unsigned long	Phase;
+};
+
+static const struct TRAFFIC Traffic[] = {
+	{ 3, 1,  10000,  100 },
+	{ 6, 2,  50000, 2000 },
+	{ 6, 12, 100000,   0 },
+	{ 7, 1,  20000, 5000 },
+};
+
+#define STREAMS		(sizeof(Traffic) / sizeof(Traffic[0]))
+
+static unsigned long	Due[STREAMS];
+static unsigned long	WorstWait[8];
+static unsigned long	Sent[8];
+static unsigned long	Rejected[8];
+static unsigned int		Queued[8];
+static unsigned int		Expected[8];
+
+static void Enqueue( unsigned char Priority, unsigned long Stamp )
+{
+	J1939_MESSAGE Msg;
+
+	Msg.Priority = Priority;
+	Msg.DataPage = 0;
+	Msg.PDUFormat = 0xFF;
+	Msg.PDUSpecific = Priority;
+	Msg.DataLength = 8;
+	Msg.Data[0] = Stamp >> 24;
+	Msg.Data[1] = Stamp >> 16;
+	Msg.Data[2] = Stamp >> 8;
+	Msg.Data[3] = Stamp;
+	Msg.Data[4] = Queued[Priority] >> 8;
+	Msg.Data[5] = Queued[Priority];
+	if (J1939_EnqueueMessage( &Msg ) == RC_SUCCESS)
+		Queued[Priority] ++;
+	else
+		Rejected[Priority] ++;
+}
+
+// Takes the message at the head of the queue, as J1939_TransmitMessages
+// does, and returns 0 if the messages of its priority are out of order.
+
+static int Send( unsigned long Now )
+{
+	J1939_MESSAGE *Msg = &(TXQueue[TX_HEAD]);
+	unsigned char Priority = Msg->Priority;
+	unsigned long Stamp;
+	unsigned int Number;
+
+	Stamp = ((unsigned long) Msg->Data[0] << 24) | ((unsigned long) Msg->Data[1] << 16) |
+			((unsigned long) Msg->Data[2] << 8) | Msg->Data[3];
+	Number = (Msg->Data[4] << 8) | Msg->Data[5];
+	#if J1939_TX_PRIORITY_BINS == J1939_TRUE
+		TXBinPop();
+	#else
+		TX_POP;
+	#endif
+
+	if (Now - Stamp > WorstWait[Priority])
+		WorstWait[Priority] = Now - Stamp;
+	Sent[Priority] ++;
+	if (Number != Expected[Priority])
+		return 0;
+	Expected[Priority] ++;
+	return 1;
+}
+
+int main( void )
+{
+	unsigned long Now;
+	unsigned char Stream;
+	unsigned char Loop;
+	unsigned char Priority;
+
+	J1939_Flags.CannotClaimAddress = 0;
+	TXQueueCount = 0;
+	#if J1939_TX_PRIORITY_BINS == J1939_TRUE
+		TXHead = TX_NO_SLOT;
+		for (Loop = 0; Loop < 8; Loop++)
+			TXBinHead[Loop] = TX_NO_SLOT;
+		for (Loop = 0; Loop < J1939_TX_QUEUE_SIZE; Loop++)
+			TXNext[Loop] = Loop + 1;
+		TXNext[J1939_TX_QUEUE_SIZE-1] = TX_NO_SLOT;
+		TXFree = 0;
+		puts( "with priority bins" );
+	#else
+		TXHead = 0;
+		TXTail = J1939_TX_QUEUE_SIZE - 1;
+		puts( "without priority bins" );
+	#endif
+
+	for (Stream = 0; Stream < STREAMS; Stream++)
+		Due[Stream] = Traffic[Stream].Phase;
+
+	// Each pass is one frame time.  The messages that came in during the
+	// last frame are queued, and then the next frame starts.
+	for (Now = 0; Now < RUN_US; Now += FRAME_US)
+	{
+		for (Stream = 0; Stream < STREAMS; Stream++)
+		{
+			while (Due[Stream] <= Now)
+			{
+				for (Loop = 0; Loop < Traffic[Stream].Count; Loop++)
+					Enqueue( Traffic[Stream].Priority, Due[Stream] );
+				Due[Stream] += Traffic[Stream].Period;
+			}
+		}
+		if (TXQueueCount != 0)
+			CHECK( Send( Now ) );
+	}
+
+	for (Priority = 0; Priority < 8; Priority++)
+	{
+		if (Sent[Priority] + Rejected[Priority] != 0)
+			printf( "priority %u: %5lu sent, %3lu rejected, worst wait %5.1f ms\n",
+					Priority, Sent[Priority], Rejected[Priority], WorstWait[Priority] / 1000.0 );
+	}
+
+	#if J1939_TX_PRIORITY_BINS == J1939_TRUE
+		CHECK( WorstWait[3] < 2 * FRAME_US );
+	#endif
+	puts( "tx_bins ok" );
+	return 0;
+}